@@ -1,3 +1,2 @@
 LAB=12
-CONFIG_KSPACE=n
 LABDEFS=-Ddebug=0
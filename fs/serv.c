@@ -39,8 +39,17 @@ struct OpenFile {
 struct OpenFile opentab[MAXOPEN] = {
         {0, 0, 1, 0}};
 
-/* Virtual address at which to receive page mappings containing client requests. */
-union Fsipc *fsreq = (union Fsipc *)0x0FFFF000;
+/* Virtual address at which to receive page mappings containing client requests.
+ * Large enough to receive a submission ring (see serve_ring_setup()). */
+union Fsipc *fsreq = (union Fsipc *)(DISKMAP - FSRING_SIZE);
+
+/* Submission rings registered by the clients */
+struct RingClient {
+    envid_t r_envid;        /* client the ring belongs to */
+    struct Fsring *r_ring;  /* ring mapping */
+};
+
+struct RingClient ringtab[MAXRINGS];
 
 void
 serve_init(void) {
@@ -50,6 +59,12 @@ serve_init(void) {
         opentab[i].o_fd = (struct Fd *)va;
         va += PAGE_SIZE;
     }
+
+    va = FSRING_BASE;
+    for (size_t i = 0; i < MAXRINGS; i++) {
+        ringtab[i].r_ring = (struct Fsring *)va;
+        va += FSRING_SIZE;
+    }
 }
 
 /* Allocate an open file. */
@@ -203,9 +218,9 @@ serve_read(envid_t envid, union Fsipc *ipc) {
     struct OpenFile *o;
     if ((res = openfile_lookup(envid, req->req_fileid, &o)) < 0)
         return res;
-    if (req->req_n > PAGE_SIZE)
-        req->req_n = PAGE_SIZE;
-    res = file_read(o->o_file, ipc->readRet.ret_buf, req->req_n, o->o_fd->fd_offset);
+    /* Read req_n only once, reply overwrites it */
+    size_t n = MIN(req->req_n, PAGE_SIZE);
+    res = file_read(o->o_file, ipc->readRet.ret_buf, n, o->o_fd->fd_offset);
     if (res > 0)
         o->o_fd->fd_offset += res;
 
@@ -229,7 +244,8 @@ serve_write(envid_t envid, union Fsipc *ipc) {
     if ((res = openfile_lookup(envid, req->req_fileid, &o)) < 0)
         return res;
 
-    res = file_write(o->o_file, req->req_buf, req->req_n, o->o_fd->fd_offset);
+    size_t n = MIN(req->req_n, sizeof(req->req_buf));
+    res = file_write(o->o_file, req->req_buf, n, o->o_fd->fd_offset);
     if (res > 0)
         o->o_fd->fd_offset += res;
     return res;
@@ -287,23 +303,118 @@ fshandler handlers[] = {
         [FSREQ_SYNC] = serve_sync};
 #define NHANDLERS (sizeof(handlers) / sizeof(handlers[0]))
 
+/* Register the ring the client has sent in place of
+ * the request page, replacing its previous ring if any.
+ * Rings of the clients that are gone (and do not map them
+ * anymore) are reused. */
+int
+serve_ring_setup(envid_t envid, int perm) {
+    if (debug) cprintf("serve_ring_setup %08x\n", envid);
+
+    if ((perm & PROT_RW) != PROT_RW || thisenv->env_ipc_maxsz != FSRING_SIZE)
+        return -E_INVAL;
+
+    struct RingClient *r = NULL;
+    for (size_t i = 0; i < MAXRINGS; i++) {
+        if (ringtab[i].r_envid == envid) {
+            r = &ringtab[i];
+            break;
+        }
+        if (!r && sys_region_refs(ringtab[i].r_ring, FSRING_SIZE) <= 1)
+            r = &ringtab[i];
+    }
+    if (!r) return -E_NO_MEM;
+
+    int res = sys_unmap_region(CURENVID, r->r_ring, FSRING_SIZE);
+    if (res < 0) return res;
+    res = sys_map_region(CURENVID, fsreq, CURENVID, r->r_ring, FSRING_SIZE, PROT_RW);
+    if (res < 0) return res;
+
+    r->r_envid = envid;
+    return 0;
+}
+
+/* Serve the requests pending in the ring of the client in order,
+ * as long as there is space to post completions.
+ * Requests are served from a private copy, since the client can
+ * change the ring meanwhile, and only replies are copied back.
+ * Returns the number of requests completed */
+int
+serve_ring_enter(envid_t envid) {
+    static union Fsipc ringreq;
+
+    if (debug) cprintf("serve_ring_enter %08x\n", envid);
+
+    struct Fsring *ring = NULL;
+    for (size_t i = 0; i < MAXRINGS; i++) {
+        if (ringtab[i].r_envid == envid &&
+            sys_region_refs(ringtab[i].r_ring, FSRING_SIZE) > 1) {
+            ring = ringtab[i].r_ring;
+            break;
+        }
+    }
+    if (!ring) return -E_INVAL;
+
+    /* Ring is writable by the client, never do more than one round */
+    int n = 0;
+    for (; n < FSRING_NENTRIES && ring->sq_head != ring->sq_tail &&
+           ring->cq_tail - ring->cq_head < FSRING_NENTRIES; n++) {
+        uint32_t slot = ring->sq_head % FSRING_NENTRIES;
+        uint32_t req = ring->sq[slot].sqe_req;
+        uint64_t data = ring->sq[slot].sqe_data;
+        memcpy(&ringreq, &ring->req[slot], sizeof(ringreq));
+
+        int64_t res = -E_INVAL;
+        if (req < NHANDLERS && handlers[req])
+            res = handlers[req](envid, &ringreq);
+
+        if (req == FSREQ_READ && res > 0)
+            memcpy(ring->req[slot].readRet.ret_buf, ringreq.readRet.ret_buf, res);
+        else if (req == FSREQ_STAT && !res)
+            memcpy(&ring->req[slot].statRet, &ringreq.statRet, sizeof(ringreq.statRet));
+
+        struct Fsring_cqe *cqe = &ring->cq[ring->cq_tail % FSRING_NENTRIES];
+        cqe->cqe_res = res;
+        cqe->cqe_data = data;
+        ring->cq_tail++;
+        ring->sq_head++;
+    }
+    return n;
+}
+
 void
 serve(void) {
-    uint32_t req, whom;
-    int perm, res;
-    void *pg;
+    uint32_t req;
+    envid_t whom, client = 0;
+    int perm = 0, res = 0;
+    void *pg = NULL;
 
     while (1) {
-        perm = 0;
-        size_t sz = PAGE_SIZE;
-        req = ipc_recv((int32_t *)&whom, fsreq, &sz, &perm);
+        /* Reply to the previous client (if any) and
+         * get the next request (with a single system call) */
+        int r = ipc_reply_wait(client, res, pg, FSRING_SIZE, perm, &whom, fsreq, &perm);
+        client = 0;
+        if (r < 0) {
+            /* Nothing was received, go back to a plain receive */
+            cprintf("fs: ipc_reply_wait failed: %i\n", r);
+            pg = NULL;
+            perm = 0;
+            continue;
+        }
+        req = r;
         if (debug) {
             cprintf("fs req %d from %08x [page %08lx: %s]\n",
                     req, whom, (unsigned long)get_uvpt_entry(fsreq),
                     (char *)fsreq);
         }
 
-        /* All requests must contain an argument page */
+        /* All requests but ring notifications must contain an argument page */
+        if (req == FSREQ_RING_ENTER) {
+            res = serve_ring_enter(whom);
+            pg = NULL;
+            client = whom;
+            continue;
+        }
         if (!(perm & PROT_R)) {
             cprintf("Invalid request from %08x: no argument page\n", whom);
             continue; /* Just leave it hanging... */
@@ -312,23 +423,28 @@ serve(void) {
         pg = NULL;
         if (req == FSREQ_OPEN) {
             res = serve_open(whom, (struct Fsreq_open *)fsreq, &pg, &perm);
+        } else if (req == FSREQ_RING_SETUP) {
+            res = serve_ring_setup(whom, perm);
         } else if (req < NHANDLERS && handlers[req]) {
             res = handlers[req](whom, fsreq);
         } else {
             cprintf("Invalid request code %d from %08x\n", req, whom);
             res = -E_INVAL;
         }
-        ipc_send(whom, res, pg, PAGE_SIZE, perm);
-        sys_unmap_region(0, fsreq, PAGE_SIZE);
+        client = whom;
     }
 }
 
 void
 umain(int argc, char **argv) {
     static_assert(sizeof(struct File) == 256, "Unsupported file size");
+    static_assert(sizeof(struct Fsring) == FSRING_SIZE, "Unsupported ring size");
     binaryname = "fs";
     cprintf("FS is running\n");
 
+    /* Every client waits for us, don't get demoted by CPU hogs */
+    sys_env_set_priority(CURENVID, ENV_PRIO_HIGH);
+
     pci_init(argv);
     nvme_init();
 
@@ -39,6 +39,10 @@ enum {
     ENV_NOT_RUNNABLE
 };
 
+/* Exit status of environment destroyed by the kernel
+ * or another environment (see sys_env_wait()) */
+#define ENV_EXIT_KILLED (-1)
+
 /* Special environment types */
 enum EnvType {
     ENV_TYPE_IDLE,
@@ -47,6 +51,12 @@ enum EnvType {
     ENV_TYPE_FS, /* File system server */
 };
 
+/* Scheduling priority levels, ENV_PRIO_HIGH is the highest one
+ * (see sys_env_set_priority()) */
+#define NPRIO         4
+#define ENV_PRIO_HIGH 0
+#define ENV_PRIO_LOW  (NPRIO - 1)
+
 struct List {
     struct List *prev, *next;
 };
@@ -55,18 +65,69 @@ struct AddressSpace {
     pml4e_t *pml4;     /* Virtual address of pml4 */
     uintptr_t cr3;     /* Physical address of pml4 */
     struct Page *root; /* root node of address space tree */
+
+    /* TLB tagging (see switch_address_space()) */
+    uint16_t pcid;      /* Process-context identifier */
+    uint64_t pcid_gen;  /* Generation pcid was assigned in (0 if none) */
+    uint32_t tlb_stale; /* CPUs that can have stale TLB entries tagged with pcid */
+
+    /* Fault-around (see force_alloc_page()) */
+    size_t fault_around;  /* Bytes of lazy memory resolved ahead of sequential faults */
+    uintptr_t fault_next; /* End of memory resolved by the previous fault */
+
+    /* Copy-on-write statistics */
+    uint64_t cow_copied;  /* Bytes copied to resolve copy-on-write faults */
+    uint64_t cow_dirtied; /* Bytes of pages written by those faults */
 };
 
+/* Fault-around window of new address spaces
+ * and the largest one (a page table page worth of memory),
+ * in pages (see sys_env_set_fault_around()) */
+#define FAULT_AROUND_DEFAULT 16
+#define FAULT_AROUND_MAX     512
+
 
 struct Env {
     struct Trapframe env_tf; /* Saved registers */
     struct Env *env_link;    /* Next free Env */
+    struct List env_runq;    /* Run queue link (while ENV_RUNNABLE) */
     envid_t env_id;          /* Unique environment identifier */
     envid_t env_parent_id;   /* env_id of this env's parent */
     enum EnvType env_type;   /* Indicates special system environments */
     unsigned env_status;     /* Status of the environment */
     uint32_t env_runs;       /* Number of times environment has run */
 
+    /* Scheduling */
+    uint32_t env_prio;        /* Current priority level */
+    bool env_prio_pinned;     /* Priority is fixed by sys_env_set_priority() */
+    uint32_t env_slice;       /* Timer ticks left in the current quantum */
+    uint32_t env_boost_epoch; /* Scheduler boost epoch env was last boosted in */
+    int env_cpunum;           /* The CPU that the env is running on or queued to */
+
+    /* Accounting (see env_account()) */
+    uint64_t env_utime;    /* TSC ticks spent in user mode */
+    uint64_t env_ktime;    /* TSC ticks spent in kernel on behalf of the env */
+    uint64_t env_acct_tsc; /* TSC value the time was last accounted at */
+    uint32_t env_nvcsw;    /* Context switches when the env blocked or yielded */
+    uint32_t env_nivcsw;   /* Context switches when the env was preempted */
+    uint32_t env_npgfault; /* Page faults */
+    uint32_t env_nipcsent; /* IPC messages sent */
+    uint32_t env_nipcrecv; /* IPC messages received */
+
+    /* Blocking with timeout (see sched_set_timeout()) */
+    struct List env_timed;                /* Link in list of timed waits */
+    uint64_t env_deadline;                /* TSC value the wait times out at */
+    void (*env_timeout)(struct Env *env); /* Called when the wait times out */
+
+    /* Futex wait (see kern/futex.c) */
+    struct List env_futex;     /* Wait queue link */
+    physaddr_t env_futex_addr; /* Physical address of the word env waits on */
+
+    /* Exit notification (see sys_env_wait()) */
+    int env_exit_status;   /* Status the env has exited with */
+    envid_t env_wait_for;  /* Child env is blocked waiting for (0 if none) */
+    int env_wait_status;   /* Exit status of the child it has waited for */
+
     uint8_t *binary; /* Pointer to process ELF image in kernel memory */
 
     /* Address space */
@@ -77,11 +138,22 @@ struct Env {
 
     /* LAB 9 IPC */
     bool env_ipc_recving;    /* Env is blocked receiving */
+    envid_t env_ipc_want;    /* Only accept message from this env (0 if any) */
     uintptr_t env_ipc_dstva; /* VA at which to map received page */
     size_t env_ipc_maxsz;    /* maximal size of received region */
     uint32_t env_ipc_value;  /* Data value sent to us */
     envid_t env_ipc_from;    /* envid of the sender */
     int env_ipc_perm;        /* Perm of page mapping received */
+
+    /* Blocked send (see sys_ipc_send()) */
+    struct List env_ipc_senders; /* Environments blocked sending to this one */
+    struct List env_ipc_link;    /* Link in the senders queue of the receiver */
+    envid_t env_ipc_to;          /* Receiver env is sending to */
+    bool env_ipc_calling;        /* Waits for the reply after sending (sys_ipc_call()) */
+    uint32_t env_ipc_send_value; /* Message being sent */
+    uintptr_t env_ipc_send_va;
+    size_t env_ipc_send_size;
+    int env_ipc_send_perm;
 };
 
 #endif /* !JOS_INC_ENV_H */
@@ -75,7 +75,12 @@ enum {
     FSREQ_STAT,
     FSREQ_FLUSH,
     FSREQ_REMOVE,
-    FSREQ_SYNC
+    FSREQ_SYNC,
+    /* Register the submission ring sent along (see struct Fsring) */
+    FSREQ_RING_SETUP,
+    /* Serve the requests submitted to the ring of the client,
+     * returns the number of requests completed */
+    FSREQ_RING_ENTER
 };
 
 union Fsipc {
@@ -118,4 +123,39 @@ union Fsipc {
     char _pad[PAGE_SIZE];
 };
 
+/* Submission/completion ring shared by a client with the file server.
+ *
+ * Client fills the request page of the next submission entry with
+ * a request just like it would fill union Fsipc for FSREQ_* IPC,
+ * and several requests are served in order with a single
+ * FSREQ_RING_ENTER IPC call. Completion i belongs to submission i,
+ * so replies (e.g. data read) are left on the request page of
+ * the entry until the completion is reaped.
+ * Requests passing pages (FSREQ_OPEN) cannot be submitted to the ring. */
+#define FSRING_NENTRIES 8
+#define FSRING_SIZE     ((FSRING_NENTRIES + 1) * PAGE_SIZE)
+
+struct Fsring_sqe {
+    uint32_t sqe_req;  /* Request code */
+    uint64_t sqe_data; /* Passed back in the completion */
+};
+
+struct Fsring_cqe {
+    int64_t cqe_res;   /* Return value of the request */
+    uint64_t cqe_data; /* sqe_data of the submission */
+};
+
+struct Fsring {
+    /* Submissions [sq_head, sq_tail) are pending, completions
+     * [cq_head, cq_tail) are not reaped yet. Indices are free-running,
+     * the client moves tails of sq and heads of cq, server does the rest */
+    volatile uint32_t sq_head, sq_tail;
+    volatile uint32_t cq_head, cq_tail;
+    struct Fsring_sqe sq[FSRING_NENTRIES];
+    struct Fsring_cqe cq[FSRING_NENTRIES];
+
+    /* Request pages of the submission entries */
+    union Fsipc req[FSRING_NENTRIES] __attribute__((aligned(PAGE_SIZE)));
+};
+
 #endif /* !JOS_INC_FS_H */
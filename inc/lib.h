@@ -39,11 +39,13 @@ void umain(int argc, char **argv);
 /* libmain.c or entry.S */
 extern const char *binaryname;
 extern const volatile int vsys[];
+extern const volatile struct Sysstat sysstat;
 extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 
 /* exit.c */
 void exit(void);
+void exit_with(int status);
 
 /* pgfault.c */
 typedef bool(pf_handler_t)(struct UTrapframe *utf);
@@ -80,6 +82,7 @@ void sys_cputs(const char *string, size_t len);
 int sys_cgetc(void);
 envid_t sys_getenvid(void);
 int sys_env_destroy(envid_t);
+void sys_env_exit(int status);
 void sys_yield(void);
 int sys_region_refs(void *va, size_t size);
 int sys_region_refs2(void *va, size_t size, void *va2, size_t size2);
@@ -87,6 +90,8 @@ static envid_t sys_exofork(void);
 int sys_env_set_status(envid_t env, int status);
 int sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+int sys_env_set_priority(envid_t env, int prio);
+int sys_env_set_fault_around(envid_t env, size_t npages);
 int sys_alloc_region(envid_t env, void *pg, size_t size, int perm);
 int sys_map_region(envid_t src_env, void *src_pg,
                    envid_t dst_env, void *dst_pg, size_t size, int perm);
@@ -94,10 +99,19 @@ int sys_map_physical_region(uintptr_t pa, envid_t dst_env,
                             void *dst_pg, size_t size, int perm);
 int sys_unmap_region(envid_t env, void *pg, size_t size);
 int sys_ipc_try_send(envid_t to_env, uint64_t value, void *pg, size_t size, int perm);
+int sys_ipc_send(envid_t to_env, uint32_t value, void *pg, size_t size, int perm, uint64_t timeout);
 int sys_ipc_recv(void *rcv_pg, size_t size);
+int sys_ipc_call(envid_t to_env, uint32_t value, void *pg, size_t size, int perm, void *rcv_pg);
+int sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, size_t size, int perm, void *rcv_pg);
 int sys_gettime(void);
+int sys_env_wait(envid_t envid, int *status);
+int sys_futex_wait(volatile uint32_t *addr, uint32_t expected, uint64_t timeout);
+int sys_futex_wake(volatile uint32_t *addr, int count);
+int sys_batch(struct SyscallBatch *calls, size_t n);
 
 int vsys_gettime(void);
+uint64_t vsys_clock_ns(void);
+uint64_t vsys_gettime_ns(void);
 
 /* This must be inlined. Exercise for reader: why? */
 static inline envid_t __attribute__((always_inline))
@@ -112,6 +126,9 @@ sys_exofork(void) {
 /* ipc.c */
 void ipc_send(envid_t to_env, uint32_t value, void *pg, size_t size, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, size_t *psize, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, size_t size, int perm, void *rcv_pg, int *perm_store);
+int32_t ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, size_t size, int perm,
+                       envid_t *from_env_store, void *rcv_pg, int *perm_store);
 envid_t ipc_find_env(enum EnvType type);
 
 /* fork.c */
@@ -142,6 +159,9 @@ int open(const char *path, int mode);
 int ftruncate(int fd, off_t size);
 int remove(const char *path);
 int sync(void);
+union Fsipc *fsring_prep(uint32_t req, uint64_t data);
+int fsring_submit(void);
+bool fsring_reap(struct Fsring_cqe *cqe, union Fsipc **reply);
 
 /* spawn.c */
 envid_t spawn(const char *program, const char **argv);
@@ -158,7 +178,7 @@ int pipe(int pipefds[2]);
 int pipeisclosed(int pipefd);
 
 /* wait.c */
-void wait(envid_t env);
+int wait(envid_t env);
 
 /* File open modes */
 #define O_RDONLY  0x0000 /* open for reading only */
@@ -17,8 +17,10 @@
 #define GD_KD   0x10 /* kernel data */
 #define GD_KT32 0x18 /* kernel text 32bit */
 #define GD_KD32 0x20 /* kernel data 32bit */
-#define GD_UT   0x28 /* user text */
-#define GD_UD   0x30 /* user data */
+/* SYSRET loads user SS and CS from two consecutive
+ * descriptors, user data has to go first */
+#define GD_UD   0x28 /* user data */
+#define GD_UT   0x30 /* user text */
 #define GD_TSS0 0x38 /* Task segment selector for CPU 0 */
 
 /*
@@ -120,6 +122,10 @@
 #define KERN_PF_STACK_SIZE (16 * PAGE_SIZE)                                    /* size of a kernel stack */
 #define KERN_STACK_GAP     (8 * PAGE_SIZE)                                     /* size of a kernel stack guard */
 #define KERN_PF_STACK_TOP  (KERN_STACK_TOP - KERN_STACK_SIZE - KERN_STACK_GAP) /* size of page fault handler stack size */
+#define KERN_STACK_STRIDE  (KERN_STACK_SIZE + KERN_PF_STACK_SIZE + 2 * KERN_STACK_GAP) /* distance between stacks of adjacent CPUs */
+
+/* Physical address of AP bootstrap code (see kern/mpentry.S) */
+#define MPENTRY_PADDR 0x7000
 
 /* Memory-mapped IO */
 #define KERN_HEAP_END   (KERN_STACK_TOP - HUGE_PAGE_SIZE)
@@ -150,6 +156,10 @@
 #define UVSYS_SIZE PAGE_SIZE
 #define UVSYS      (UENVS - UVSYS_SIZE)
 
+/* System call and trap statistics (struct Sysstat) */
+#define USYSSTAT_SIZE (2 * PAGE_SIZE)
+#define USYSSTAT      (UVSYS - USYSSTAT_SIZE)
+
 /*
  * Top of user VM. User can manipulate VA from MAX_USER_ADDRESS-1 and down!
  */
@@ -168,6 +178,10 @@
 /* Max number of open files in the file system at once */
 #define MAXOPEN   512
 #define FILE_BASE 0x200000000
+/* Max number of clients with submission rings
+ * mapped by the file system (see inc/fs.h) */
+#define MAXRINGS    256
+#define FSRING_BASE 0x300000000
 
 #ifdef SAN_ENABLE_KASAN
 /* (this *should* be defined as a literal number) */
@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
     SYS_cputs = 0,
@@ -19,8 +21,49 @@ enum {
     SYS_yield,
     SYS_ipc_try_send,
     SYS_ipc_recv,
+    SYS_ipc_send,
+    SYS_ipc_call,
+    SYS_ipc_reply_wait,
     SYS_gettime,
+    SYS_env_set_priority,
+    SYS_env_wait,
+    SYS_futex_wait,
+    SYS_futex_wake,
+    SYS_batch,
+    SYS_env_set_fault_around,
+    SYS_env_exit,
     NSYSCALLS
 };
 
+/* Maximal number of system calls in one sys_batch() */
+#define SYSBATCH_MAX 64
+
+/* System call executed by sys_batch() */
+struct SyscallBatch {
+    uint64_t sb_num;     /* System call number */
+    uint64_t sb_args[6]; /* Its arguments */
+    int64_t sb_res;      /* Its return value */
+};
+
+/* Latency histogram of a system call has SYSSTAT_NBUCKETS buckets,
+ * bucket i counts calls taking [2^(i + SYSSTAT_SHIFT), 2^(i + SYSSTAT_SHIFT + 1))
+ * TSC ticks, the first and the last ones also count faster and slower calls */
+#define SYSSTAT_NBUCKETS 16
+#define SYSSTAT_SHIFT    6
+
+/* Number of trap numbers counted */
+#define SYSSTAT_NTRAPS 256
+
+struct SyscallStat {
+    uint64_t ss_count;  /* Number of calls */
+    uint64_t ss_cycles; /* Total TSC ticks spent in calls that returned */
+    uint64_t ss_hist[SYSSTAT_NBUCKETS];
+};
+
+/* Kernel statistics, mapped read-only to every environment at USYSSTAT */
+struct Sysstat {
+    struct SyscallStat st_syscalls[NSYSCALLS];
+    uint64_t st_traps[SYSSTAT_NTRAPS]; /* Number of traps by trap number */
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
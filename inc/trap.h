@@ -38,7 +38,10 @@
 #define IRQ_SPURIOUS 7
 #define IRQ_CLOCK    8
 #define IRQ_IDE      14
+#define IRQ_LAPIC_TIMER 17 /* Local APIC timer */
+#define IRQ_RESCHED     18 /* Inter-processor interrupt waking up idle CPU */
 #define IRQ_ERROR    19
+#define IRQ_TLB_SHOOTDOWN 20 /* Inter-processor interrupt flushing TLB */
 
 #define UTRAP_RSP 152
 #define UTRAP_RIP 136
@@ -1,10 +1,26 @@
 #ifndef JOS_INC_VSYSCALL_H
 #define JOS_INC_VSYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
-    VSYS_gettime,
-    NVSYSCALLS
+    VSYS_gettime, /* Wall clock time at boot, see struct VsysClock */
+    VSYS_syscall, /* SYSCALL instruction can be used to enter the kernel */
+    VSYS_clock = 4, /* struct VsysClock (8-byte aligned) */
+    NVSYSCALLS = VSYS_clock + 8
+};
+
+/* TSC based clock published at &vsys[VSYS_clock].
+ * Time since vc_base_tsc is (rdtsc - vc_base_tsc) / vc_tsc_freq seconds.
+ * Kernel makes vc_seq odd while updating the fields, so they are
+ * consistent if vc_seq is even and has not changed while reading them */
+struct VsysClock {
+    uint32_t vc_seq;
+    uint32_t vc_pad;
+    uint64_t vc_tsc_freq;  /* TSC ticks per second */
+    uint64_t vc_base_tsc;  /* TSC value at vc_base_time */
+    uint64_t vc_base_time; /* Wall clock time (seconds since epoch) */
 };
 
 #endif /* !JOS_INC_VSYSCALL_H */
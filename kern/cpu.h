@@ -6,11 +6,85 @@
 #include <inc/memlayout.h>
 #include <inc/mmu.h>
 #include <inc/env.h>
+#include <inc/x86.h>
+#include <inc/assert.h>
 
-#define NCPU 1
+struct Timer;
 
-/* Used by x86 to find stack for interrupt */
-extern struct Taskstate cpu_ts;
+/* Maximum number of CPUs */
+#define NCPU 8
+
+static_assert(NCPU * KERN_STACK_STRIDE <= HUGE_PAGE_SIZE, "Kernel stacks of all CPUs should fit into their area");
+
+/* Values of status in struct CpuInfo */
+enum {
+    CPU_UNUSED = 0,
+    CPU_STARTED,
+    CPU_HALTED,
+};
+
+/* Per-CPU state */
+struct CpuInfo {
+    /* SYSCALL does not switch stacks, syscall_entry (kern/trapentry.S)
+     * finds kernel stack here through GS base after swapgs.
+     * Keep these first, their offsets are hardcoded there */
+    uintptr_t cpu_kstack;   /* Top of the kernel stack */
+    uintptr_t cpu_user_rsp; /* User RSP while switching stacks */
+
+    uint8_t cpu_apicid;             /* Local APIC ID */
+    volatile unsigned cpu_status;   /* The status of the CPU */
+    struct Env *cpu_env;            /* The currently-running environment */
+    struct AddressSpace *cpu_space; /* Currently loaded address space */
+    bool cpu_tlb_stale;             /* TLB can have stale entries of any PCID */
+    volatile bool cpu_tlb_shootdown; /* Loaded space has to be flushed (see tlb_shootdown()) */
+    bool cpu_in_page_fault;         /* Handling #PF (recursive ones are not supported) */
+    struct Taskstate cpu_ts;        /* Used by x86 to find stack for interrupt */
+
+    /* Timer driving the scheduler on this CPU */
+    struct Timer *cpu_timer;
+    uint64_t cpu_timer_deadline; /* TSC value it is programmed to fire at (0 if stopped) */
+
+    /* Idle time accounting */
+    uint64_t cpu_idle_start; /* TSC value when CPU has been halted */
+    uint64_t cpu_idle_tsc;   /* Total TSC ticks spent halted */
+
+    /* Run queues of the CPU (see kern/sched.c) */
+    struct List cpu_runq[NPRIO];
+    uint32_t cpu_runq_mask;  /* Bitmask of non-empty run queues */
+    uint32_t cpu_nrunnable;  /* Number of queued environments */
+};
+
+/* Initialized in mpconfig.c */
+extern struct CpuInfo cpus[NCPU];
+extern int ncpu;                /* Total number of CPUs in the system */
+extern struct CpuInfo *bootcpu; /* The boot-strap processor (BSP) */
+extern physaddr_t lapicaddr;    /* Physical MMIO address of the local APIC */
+
+/* Per-CPU kernel stacks */
+extern unsigned char percpu_kstacks[NCPU][KERN_STACK_SIZE];
+extern unsigned char percpu_pfstacks[NCPU][KERN_PF_STACK_SIZE];
+
+/* Returns index of the current CPU in cpus[].
+ *
+ * Every CPU runs kernel code on its own kernel or #PF stack,
+ * stacks of CPU i are located i * KERN_STACK_STRIDE bytes
+ * below the ones of CPU 0, so the index can be obtained
+ * from the stack pointer without touching memory.
+ * The only other stack is bootstack BSP runs i386_init() on */
+static inline int __attribute__((always_inline))
+cpunum(void) {
+    uintptr_t rsp = read_rsp();
+    if (rsp > KERN_STACK_TOP || rsp <= KERN_STACK_TOP - NCPU * KERN_STACK_STRIDE) return 0;
+    return (KERN_STACK_TOP - rsp) / KERN_STACK_STRIDE;
+}
+
+#define thiscpu (&cpus[cpunum()])
+
+void mp_init(void);
+void lapic_init(void);
+void lapic_startap(uint8_t apicid, physaddr_t addr);
+void lapic_eoi(void);
+void lapic_ipi(struct CpuInfo *cpu, int vector);
 
 extern char in_intr;
 extern bool in_clk_intr;
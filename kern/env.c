@@ -9,7 +9,10 @@
 #include <inc/vsyscall.h>
 
 #include <kern/env.h>
+#include <kern/futex.h>
+#include <kern/kclock.h>
 #include <kern/kdebug.h>
+#include <kern/list.h>
 #include <kern/macro.h>
 #include <kern/monitor.h>
 #include <kern/pmap.h>
@@ -18,10 +21,10 @@
 #include <kern/timer.h>
 #include <kern/traceopt.h>
 #include <kern/trap.h>
+#include <kern/tsc.h>
 #include <kern/vsyscall.h>
-
-/* Currently active environment */
-struct Env *curenv = NULL;
+#include <kern/spinlock.h>
+#include <kern/syscall.h>
 
 #ifdef CONFIG_KSPACE
 /* All environments */
@@ -106,6 +109,14 @@ env_init(void) { //!!
         vsys = kzalloc_region(UVSYS_SIZE);
         memset((void *)vsys, 0, ROUNDUP(UVSYS_SIZE, PAGE_SIZE));
         map_region(current_space, UVSYS, &kspace, (uintptr_t)vsys, UVSYS_SIZE, PROT_R | PROT_USER_);
+        vsys_clock_update();
+        /* SYSCALL is enabled by trap_init_percpu() if supported */
+        vsys[VSYS_syscall] = !!(rdmsr(EFER_MSR) & EFER_SCE);
+
+        static_assert(sizeof(struct Sysstat) <= USYSSTAT_SIZE, "struct Sysstat does not fit into USYSSTAT");
+        sysstat = kzalloc_region(USYSSTAT_SIZE);
+        memset(sysstat, 0, USYSSTAT_SIZE);
+        map_region(current_space, USYSSTAT, &kspace, (uintptr_t)sysstat, USYSSTAT_SIZE, PROT_R | PROT_USER_);
         assert(envs_size <= UENVS_SIZE);
         if (map_region(current_space, (uintptr_t)UENVS, &kspace, (uintptr_t)envs, (size_t)UENVS_SIZE, PROT_R | PROT_USER_)) panic("Failed to map region %p to %p", (void *)envs, (void *)UENVS);
 
@@ -127,6 +138,11 @@ env_init(void) { //!!
     env_free_list = envs;
     for (int i = 0; i < NENV; i++) {
         envs[i].env_status = ENV_FREE;
+        list_init(&envs[i].env_runq);
+        list_init(&envs[i].env_timed);
+        list_init(&envs[i].env_futex);
+        list_init(&envs[i].env_ipc_senders);
+        list_init(&envs[i].env_ipc_link);
         envs[i].env_id = 0;
         envs[i].env_link = envs + 1 + i;
     }
@@ -166,8 +182,18 @@ env_alloc(struct Env **newenv_store, envid_t parent_id, enum EnvType type) {
 #else
     env->env_type = type;
 #endif
-    env->env_status = ENV_RUNNABLE;
     env->env_runs = 0;
+    env->env_prio = ENV_PRIO_HIGH;
+    env->env_prio_pinned = 0;
+    env->env_slice = 0;
+    env->env_cpunum = cpunum();
+    env->env_utime = env->env_ktime = 0;
+    env->env_nvcsw = env->env_nivcsw = 0;
+    env->env_npgfault = 0;
+    env->env_nipcsent = env->env_nipcrecv = 0;
+    env->env_exit_status = ENV_EXIT_KILLED;
+    env->env_wait_for = 0;
+    env_set_status(env, ENV_RUNNABLE);
 
     /* Clear out all the saved register state,
      * to prevent the register values
@@ -211,6 +237,8 @@ env_alloc(struct Env **newenv_store, envid_t parent_id, enum EnvType type) {
 
     /* Also clear the IPC receiving flag. */
     env->env_ipc_recving = 0;
+    env->env_ipc_want = 0;
+    env->env_ipc_calling = 0;
 
     /* Commit the allocation */
     env_free_list = env->env_link;
@@ -438,6 +466,18 @@ env_create(uint8_t *binary, size_t size, enum EnvType type) {
 }
 
 
+/* Sets env status keeping the run queue consistent:
+ * environment is linked into it iff it is ENV_RUNNABLE */
+void
+env_set_status(struct Env *env, unsigned status) {
+    if (env->env_status == ENV_RUNNABLE && status != ENV_RUNNABLE)
+        sched_dequeue(env);
+    else if (env->env_status != ENV_RUNNABLE && status == ENV_RUNNABLE)
+        sched_enqueue(env);
+
+    env->env_status = status;
+}
+
 /* Frees env and all memory it uses */
 void
 env_free(struct Env *env) {
@@ -445,6 +485,8 @@ env_free(struct Env *env) {
     /* Note the environment's demise. */
     if (trace_envs) cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, env->env_id);
 
+    futex_release(env);
+
 #ifndef CONFIG_KSPACE
     /* If freeing the current environment, switch to kern_pgdir
      * before freeing the page directory, just in case the page
@@ -456,8 +498,25 @@ env_free(struct Env *env) {
     release_address_space(&env->address_space);
 #endif
 
+    futex_cancel(env);
+    ipc_cancel(env);
+    sched_clear_timeout(env);
+
+    /* Wake up parent if it is waiting for us in sys_env_wait() */
+    struct Env *parent = &envs[ENVX(env->env_parent_id)];
+    if (env->env_parent_id && parent->env_id == env->env_parent_id &&
+        parent->env_wait_for == env->env_id) {
+        parent->env_wait_for = 0;
+        if (parent->env_status == ENV_NOT_RUNNABLE) {
+            parent->env_wait_status = env->env_exit_status;
+            env_set_status(parent, ENV_RUNNABLE);
+        }
+    }
+    /* Recycled envid must not match a stale wait */
+    env->env_wait_for = 0;
+
     /* Return the environment to the free list */
-    env->env_status = ENV_FREE;
+    env_set_status(env, ENV_FREE);
     env->env_link = env_free_list;
     env_free_list = env;
 }
@@ -476,6 +535,11 @@ env_destroy(struct Env *env) {
     // LAB 3: Your code here
     // LAB 10: Your code here
 
+    if (env->env_status == ENV_RUNNING && curenv != env) {
+        env_set_status(env, ENV_DYING);
+        return;
+    }
+
     env_free(env);
 
     if (curenv == env)
@@ -536,6 +600,73 @@ env_pop_tf(struct Trapframe *tf) {
     panic("Reached unrecheble\n");
 }
 
+/* Publish wall clock time based on TSC in the vsyscall page,
+ * user code computes the current time from it without system calls.
+ * CMOS clock is read only here, not on timer interrupts */
+void
+vsys_clock_update(void) {
+    static_assert(sizeof(struct VsysClock) <= (NVSYSCALLS - VSYS_clock) * sizeof(int), "VsysClock does not fit");
+    volatile struct VsysClock *clock = (volatile struct VsysClock *)&vsys[VSYS_clock];
+
+    uint64_t time = gettime();
+    uint64_t tsc = read_tsc();
+
+    clock->vc_seq++;
+    clock->vc_tsc_freq = tsc_calibrate();
+    clock->vc_base_tsc = tsc;
+    clock->vc_base_time = time;
+    clock->vc_seq++;
+
+    vsys[VSYS_gettime] = time;
+}
+
+/* Return to the current environment that has entered the kernel
+ * with SYSCALL (see syscall_trap()) and keeps running.
+ * Registers are restored like env_pop_tf() does, but SYSRET
+ * takes RIP and RFLAGS from RCX and R11 instead of the stack */
+_Noreturn void
+env_sysret(struct Trapframe *tf) {
+    asm volatile(
+            "movq %0, %%rsp\n"
+            "movq 0(%%rsp), %%r15\n"
+            "movq 8(%%rsp), %%r14\n"
+            "movq 16(%%rsp), %%r13\n"
+            "movq 24(%%rsp), %%r12\n"
+            "movq 40(%%rsp), %%r10\n"
+            "movq 48(%%rsp), %%r9\n"
+            "movq 56(%%rsp), %%r8\n"
+            "movq 64(%%rsp), %%rsi\n"
+            "movq 72(%%rsp), %%rdi\n"
+            "movq 80(%%rsp), %%rbp\n"
+            "movq 88(%%rsp), %%rdx\n"
+            "movq 104(%%rsp), %%rbx\n"
+            "movq 112(%%rsp), %%rax\n"
+            "movw 120(%%rsp), %%es\n"
+            "movw 128(%%rsp), %%ds\n"
+            "movq 152(%%rsp), %%rcx\n" /* tf_rip */
+            "movq 168(%%rsp), %%r11\n" /* tf_rflags */
+            "movq 176(%%rsp), %%rsp\n" /* tf_rsp */
+            "sysretq" ::"g"(tf)
+            : "memory");
+
+    /* Mostly to placate the compiler */
+    panic("Reached unrecheble\n");
+}
+
+/* Charge TSC ticks elapsed since the last call to user
+ * or kernel time of env. It is called on every kernel entry
+ * from user mode and before returning there */
+void
+env_account(struct Env *env, bool user) {
+    uint64_t now = read_tsc();
+
+    if (user)
+        env->env_utime += now - env->env_acct_tsc;
+    else
+        env->env_ktime += now - env->env_acct_tsc;
+    env->env_acct_tsc = now;
+}
+
 /* Context switch from curenv to env.
  * This function does not return.
  *
@@ -569,20 +700,41 @@ env_run(struct Env *env) {
 
     // LAB 3: Your code here
 
+    if (curenv && curenv != env) {
+        /* Preemption is counted by sched_preempt() and sched_handoff(),
+         * yield by sys_yield() */
+        if (curenv->env_status != ENV_RUNNING) curenv->env_nvcsw++;
+        env_account(curenv, 0);
+    }
+
     if (curenv) {
         if (curenv->env_status == ENV_RUNNING) {
-            curenv->env_status = ENV_RUNNABLE;
+            env_set_status(curenv, ENV_RUNNABLE);
         }
     }
 
     if (env->env_status != ENV_RUNNABLE)
         panic("Error. Scheduled process is not runnable");
 
+    /* Env resumed after waiting is not charged for the wait */
+    if (curenv != env) env->env_acct_tsc = read_tsc();
+
     curenv = env;
-    curenv->env_status = ENV_RUNNING;
+    env_set_status(curenv, ENV_RUNNING);
     curenv->env_runs += 1;
 
+    /* TLB of this CPU can hold stale translations of the environment
+     * if it had been running on another CPU since it left this one */
+    bool migrated = curenv->env_cpunum != cpunum();
+    curenv->env_cpunum = cpunum();
+
+    if (migrated) curenv->address_space.tlb_stale |= 1U << cpunum();
     switch_address_space(&curenv->address_space);
+
+    sched_timer_update();
+
+    env_account(curenv, 0);
+    unlock_kernel();
     env_pop_tf(&curenv->env_tf);
 
     while (1);
@@ -4,13 +4,12 @@
 #define JOS_KERN_ENV_H
 
 #include <inc/env.h>
-
-#define NCPU 1
+#include <kern/cpu.h>
 
 /* All environments */
 extern struct Env *envs;
 /* Currently active environment */
-extern struct Env *curenv;
+#define curenv (thiscpu->cpu_env)
 extern struct Segdesc32 gdt[];
 
 void env_init(void);
@@ -18,10 +17,13 @@ int env_alloc(struct Env **penv, envid_t parent_id, enum EnvType type);
 void env_free(struct Env *env);
 void env_create(uint8_t *binary, size_t size, enum EnvType type);
 void env_destroy(struct Env *env);
+void env_set_status(struct Env *env, unsigned status);
 
 int envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 _Noreturn void env_run(struct Env *e);
+void env_account(struct Env *env, bool user);
 _Noreturn void env_pop_tf(struct Trapframe *tf);
+_Noreturn void env_sysret(struct Trapframe *tf);
 
 #ifdef CONFIG_KSPACE
 extern void sys_exit(void);
@@ -0,0 +1,156 @@
+/* Fast userspace mutexes.
+ *
+ * Environment can block until a 32-bit word in its memory is changed
+ * by another one. Wait queues are keyed by the physical address
+ * of the word, so environments sharing a page (PROT_SHARE mappings)
+ * can wait on it regardless of the virtual addresses it is mapped at.
+ * Writable lazy pages (zero-filled or copy-on-write) are shared with
+ * unrelated environments, so they are copied before the key is taken. */
+
+#include <inc/error.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/env.h>
+#include <kern/futex.h>
+#include <kern/list.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+
+#define FUTEX_HASH_SIZE 64
+
+/* Waiting environments linked by Env->env_futex */
+static struct List futex_queues[FUTEX_HASH_SIZE];
+
+static struct List *
+futex_queue(physaddr_t key) {
+    return &futex_queues[((key >> 2) ^ (key >> CLASS_BASE)) % FUTEX_HASH_SIZE];
+}
+
+void
+futex_init(void) {
+    for (int i = 0; i < FUTEX_HASH_SIZE; i++)
+        list_init(&futex_queues[i]);
+}
+
+/* Find physical address of the word at addr
+ * in the address space of env */
+static int
+futex_key(struct Env *env, uintptr_t addr, physaddr_t *key) {
+    if (addr >= MAX_USER_ADDRESS || addr & (sizeof(uint32_t) - 1)) return -E_INVAL;
+
+    /* Resolve the page as if the word were written */
+    if (!region_phys(&env->address_space, addr, PROT_USER_ | PROT_W | PROT_LAZY, key)) {
+        int res = force_alloc_page(&env->address_space, addr, 0);
+        if (res < 0) return res;
+    }
+
+    int res = region_phys(&env->address_space, addr, PROT_USER_, key);
+    if (res < 0) return res;
+
+    /* Device memory is not accessible through the kernel mapping */
+    if (*key + sizeof(uint32_t) - 1 > max_memory_map_addr) return -E_FAULT;
+
+    return 0;
+}
+
+/* Remove env from wait queues without waking it up */
+void
+futex_cancel(struct Env *env) {
+    if (list_empty(&env->env_futex)) return;
+
+    list_del(&env->env_futex);
+    sched_clear_timeout(env);
+}
+
+/* Remove env from wait queues and make it runnable,
+ * sys_futex_wait() returns res.
+ * Environment could have already been resumed by sys_env_set_status() */
+static void
+futex_unqueue(struct Env *env, int res) {
+    futex_cancel(env);
+
+    if (env->env_status == ENV_NOT_RUNNABLE) {
+        env->env_tf.tf_regs.reg_rax = res;
+        env_set_status(env, ENV_RUNNABLE);
+    }
+}
+
+static void
+futex_timeout(struct Env *env) {
+    futex_unqueue(env, -E_TIMEOUT);
+}
+
+/* Block env on the word at addr if it still contains expected.
+ * Wait is interrupted after timeout nanoseconds unless timeout is 0.
+ *
+ * Returns 0 if env is blocked, < 0 on error. Errors are:
+ *  -E_INVAL if addr is not a properly aligned user address.
+ *  -E_FAULT if addr is not mapped.
+ *  -E_AGAIN if the value is not equal to expected. */
+int
+futex_wait(struct Env *env, uintptr_t addr, uint32_t expected, uint64_t timeout) {
+    physaddr_t key;
+    int res = futex_key(env, addr, &key);
+    if (res < 0) return res;
+
+    if (*(volatile uint32_t *)KADDR(key) != expected) return -E_AGAIN;
+
+    futex_cancel(env);
+    env->env_futex_addr = key;
+    list_append(futex_queue(key)->prev, &env->env_futex);
+    if (timeout) sched_set_timeout(env, timeout, futex_timeout);
+
+    /* Woken up environment gets 0,
+     * the one that has timed out gets -E_TIMEOUT */
+    env->env_tf.tf_regs.reg_rax = 0;
+    env_set_status(env, ENV_NOT_RUNNABLE);
+    return 0;
+}
+
+/* Wake up to count environments waiting on the word at addr
+ * in the order they started waiting.
+ *
+ * Returns number of woken environments, < 0 on error
+ * (see futex_wait()) */
+int
+futex_wake(struct Env *env, uintptr_t addr, int count) {
+    physaddr_t key;
+    int res = futex_key(env, addr, &key);
+    if (res < 0) return res;
+
+    struct List *queue = futex_queue(key);
+    int woken = 0;
+    for (struct List *li = queue->next, *next; li != queue && woken < count; li = next) {
+        next = li->next;
+        struct Env *waiter = LIST_ENTRY(li, struct Env, env_futex);
+        if (waiter->env_futex_addr != key) continue;
+
+        futex_unqueue(waiter, 0);
+        woken++;
+    }
+
+    return woken;
+}
+
+/* Wake up every environment waiting on a word in [start, start + size) */
+static void
+futex_wake_range(physaddr_t start, size_t size) {
+    for (int i = 0; i < FUTEX_HASH_SIZE; i++) {
+        struct List *queue = &futex_queues[i];
+        for (struct List *li = queue->next, *next; li != queue; li = next) {
+            next = li->next;
+            struct Env *waiter = LIST_ENTRY(li, struct Env, env_futex);
+            if (waiter->env_futex_addr - start < size) futex_unqueue(waiter, 0);
+        }
+    }
+}
+
+/* Env is going away without necessarily waking up the ones
+ * waiting on memory it shares with them (e.g. the other end
+ * of a pipe), wake them up so that they recheck their condition */
+void
+futex_release(struct Env *env) {
+    futex_cancel(env);
+    shared_regions(&env->address_space, futex_wake_range);
+}
@@ -0,0 +1,19 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+void futex_init(void);
+int futex_wait(struct Env *env, uintptr_t addr, uint32_t expected, uint64_t timeout);
+int futex_wake(struct Env *env, uintptr_t addr, int count);
+void futex_cancel(struct Env *env);
+void futex_release(struct Env *env);
+
+#endif /* !JOS_KERN_FUTEX_H */
@@ -14,10 +14,15 @@
 #include <kern/timer.h>
 #include <kern/trap.h>
 #include <kern/sched.h>
+#include <kern/futex.h>
 #include <kern/picirq.h>
 #include <kern/kclock.h>
 #include <kern/kdebug.h>
 #include <kern/traceopt.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+static void boot_aps(void);
 
 void
 timers_init(void) {
@@ -44,6 +49,7 @@ timers_schedule(const char *name) {
             }
 
             timer_for_schedule = &timertab[i];
+            thiscpu->cpu_timer = timer_for_schedule;
             timertab[i].enable_interrupts();
             return;
         }
@@ -153,10 +159,21 @@ i386_init(void) {
 
     /* User environment initialization functions */
     env_init();
+    sched_init();
+    futex_init();
 
     /* Choose the timer used for scheduling: hpet or pit */
     timers_schedule("hpet0");
 
+    /* Multiprocessor initialization functions */
+    mp_init();
+
+    /* Acquire the big kernel lock before waking up APs */
+    lock_kernel();
+
+    /* Starting non-boot CPUs */
+    boot_aps();
+
 #ifdef CONFIG_KSPACE
     /* Touch all you want */
     ENV_CREATE_KERNEL_TYPE(prog_test1);
@@ -187,6 +204,64 @@ i386_init(void) {
     sched_yield();
 }
 
+/* While boot_aps is booting a given CPU, it communicates the per-core
+ * stack pointer that should be loaded by mpentry.S to that CPU in
+ * this variable. */
+void *mpentry_kstack;
+
+/* Start the non-boot (AP) processors. */
+static void
+boot_aps(void) {
+    extern unsigned char mpentry_start[], mpentry_end[];
+    extern unsigned char mpentry_cr3[], mpentry_efer[];
+
+    /* Write entry code to unused memory at MPENTRY_PADDR */
+    unsigned char *code = KADDR(MPENTRY_PADDR);
+    memmove(code, mpentry_start, mpentry_end - mpentry_start);
+
+    /* APs load page table root while still in 32-bit mode */
+    assert(kspace.cr3 < 4 * GB);
+    *(uint32_t *)(code + (mpentry_cr3 - mpentry_start)) = kspace.cr3;
+    *(uint32_t *)(code + (mpentry_efer - mpentry_start)) = (rdmsr(EFER_MSR) | EFER_LME) & ~EFER_LMA;
+
+    /* Boot each AP one at a time */
+    for (struct CpuInfo *c = cpus; c < cpus + ncpu; c++) {
+        if (c == bootcpu) continue;
+
+        /* Tell mpentry.S what stack to use */
+        mpentry_kstack = (void *)(KERN_STACK_TOP - (c - cpus) * KERN_STACK_STRIDE);
+        /* Start the CPU at mpentry_start */
+        lapic_startap(c->cpu_apicid, MPENTRY_PADDR);
+        /* Wait for the CPU to finish some basic setup in mp_main() */
+        while (c->cpu_status != CPU_STARTED) asm volatile("pause");
+    }
+}
+
+/* Setup code for APs */
+void
+mp_main(void) {
+    /* Same control registers as BSP sets in init_memory() */
+    lcr0(CR0_PE | CR0_PG | CR0_AM | CR0_WP | CR0_NE | CR0_MP);
+    lcr4(CR4_PSE | CR4_PAE | CR4_PCE | (pcid_enabled ? CR4_PCIDE : 0));
+    current_space = &kspace;
+
+    if (trace_init) cprintf("SMP: CPU %d starting\n", thiscpu->cpu_apicid);
+
+    lapic_init();
+    trap_init_percpu();
+    xchg(&thiscpu->cpu_status, CPU_STARTED); /* tell boot_aps() we're up */
+
+    /* Now that we have finished some basic setup, call sched_yield()
+     * to start running processes on this CPU.  But make sure that
+     * only one CPU can enter the scheduler at a time! */
+    lock_kernel();
+
+    /* BSP is driven by HPET through PIC, APs use their local APIC timers */
+    thiscpu->cpu_timer = &timer_lapic;
+
+    sched_yield();
+}
+
 /* Variable panicstr contains argument to first call to panic; used as flag
  * to indicate that the kernel has already called panic. */
 const char *panicstr = NULL;
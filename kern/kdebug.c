@@ -95,9 +95,7 @@ debuginfo_rip(uintptr_t addr, struct Ripdebuginfo *info) {
 
     // LAB 8: Your code here:
 
-    uintptr_t old_cr3 = curenv->address_space.cr3;
-    if (old_cr3 != kspace.cr3)
-        lcr3(kspace.cr3);
+    struct AddressSpace *old_space = switch_address_space(&kspace);
 
     /* Load dwarf section pointers from either
      * currently running program binary or use
@@ -149,6 +147,7 @@ debuginfo_rip(uintptr_t addr, struct Ripdebuginfo *info) {
 
 
 error:
+    if (old_space) switch_address_space(old_space);
     return res;
 }
 
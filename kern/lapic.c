@@ -0,0 +1,192 @@
+/* The local APIC manages internal (non-I/O) interrupts.
+ * See Chapter 8 & Appendix C of Intel processor manual volume 3. */
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/trap.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/tsc.h>
+#include <kern/timer.h>
+
+/* Local APIC registers, divided by 4 for use as uint32_t[] indices. */
+#define ID    (0x0020 / 4) /* ID */
+#define VER   (0x0030 / 4) /* Version */
+#define TPR   (0x0080 / 4) /* Task Priority */
+#define EOI   (0x00B0 / 4) /* EOI */
+#define SVR   (0x00F0 / 4) /* Spurious Interrupt Vector */
+#define ENABLE     0x00000100 /* Unit Enable */
+#define ESR   (0x0280 / 4) /* Error Status */
+#define ICRLO (0x0300 / 4) /* Interrupt Command */
+#define INIT       0x00000500 /* INIT/RESET */
+#define STARTUP    0x00000600 /* Startup IPI */
+#define DELIVS     0x00001000 /* Delivery status */
+#define ASSERT     0x00004000 /* Assert interrupt (vs deassert) */
+#define DEASSERT   0x00000000
+#define LEVEL      0x00008000 /* Level triggered */
+#define BCAST      0x00080000 /* Send to all APICs, including self. */
+#define OTHERS     0x000C0000 /* Send to all APICs, excluding self. */
+#define BUSY       0x00001000
+#define FIXED      0x00000000
+#define ICRHI (0x0310 / 4) /* Interrupt Command [63:32] */
+#define TIMER (0x0320 / 4) /* Local Vector Table 0 (TIMER) */
+#define X1         0x0000000B /* divide counts by 1 */
+#define X16        0x00000003 /* divide counts by 16 */
+#define PERIODIC   0x00020000 /* Periodic */
+#define PCINT (0x0340 / 4) /* Performance Counter LVT */
+#define LINT0 (0x0350 / 4) /* Local Vector Table 1 (LINT0) */
+#define LINT1 (0x0360 / 4) /* Local Vector Table 2 (LINT1) */
+#define ERROR (0x0370 / 4) /* Local Vector Table 3 (ERROR) */
+#define MASKED     0x00010000 /* Interrupt masked */
+#define TICR  (0x0380 / 4) /* Timer Initial Count */
+#define TCCR  (0x0390 / 4) /* Timer Current Count */
+#define TDCR  (0x03E0 / 4) /* Timer Divide Configuration */
+
+/* Duration of LAPIC timer calibration in microseconds */
+#define LAPIC_CALIBRATE_US 10000
+
+static volatile uint32_t *lapic;
+/* LAPIC timer frequency with X16 divider */
+static uint64_t lapic_timer_freq;
+
+static void
+lapicw(int index, int value) {
+    lapic[index] = value;
+    lapic[ID]; /* wait for write to finish, by reading */
+}
+
+/* Spin for a given number of microseconds */
+static void
+microdelay(uint64_t us) {
+    uint64_t start = read_tsc();
+    uint64_t ticks = tsc_calibrate() / 1000000 * us;
+    while (read_tsc() - start < ticks) asm volatile("pause");
+}
+
+/* Measure LAPIC timer frequency against TSC */
+static void
+lapic_timer_calibrate(void) {
+    lapicw(TDCR, X16);
+    lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_LAPIC_TIMER));
+    lapicw(TICR, ~0U);
+    microdelay(LAPIC_CALIBRATE_US);
+    uint32_t elapsed = ~0U - lapic[TCCR];
+    lapicw(TICR, 0);
+
+    lapic_timer_freq = (uint64_t)elapsed * (1000000 / LAPIC_CALIBRATE_US);
+}
+
+void
+lapic_init(void) {
+    if (!lapicaddr) return;
+
+    /* lapicaddr is the physical address of the LAPIC's 4K MMIO
+     * region. Map it in to virtual memory so we can access it. */
+    if (!lapic) lapic = mmio_map_region(lapicaddr, PAGE_SIZE);
+
+    thiscpu->cpu_apicid = lapic[ID] >> 24;
+
+    /* Enable local APIC; set spurious interrupt vector. */
+    lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
+
+    /* Leave LINT0 of the BSP enabled so that it can get
+     * interrupts from the 8259A chip.
+     *
+     * Firmware initializes BSP's local APIC in Virtual Wire Mode,
+     * in which 8259A's INTR is virtually connected to BSP's LINTIN0.
+     * In this mode, we do not need to program the IOAPIC.
+     * NMI (LINT1) is left as configured by firmware there as well. */
+    if (thiscpu != bootcpu) {
+        lapicw(LINT0, MASKED);
+        lapicw(LINT1, MASKED);
+    }
+
+    /* Disable performance counter overflow interrupts
+     * on machines that provide that interrupt entry. */
+    if (((lapic[VER] >> 16) & 0xFF) >= 4)
+        lapicw(PCINT, MASKED);
+
+    /* Errors are not handled, mask error interrupt. */
+    lapicw(ERROR, MASKED | (IRQ_OFFSET + IRQ_ERROR));
+
+    /* Clear error status register (requires back-to-back writes). */
+    lapicw(ESR, 0);
+    lapicw(ESR, 0);
+
+    /* Ack any outstanding interrupts. */
+    lapicw(EOI, 0);
+
+    /* Send an Init Level De-Assert to synchronize arbitration ID's. */
+    lapicw(ICRHI, 0);
+    lapicw(ICRLO, BCAST | INIT | LEVEL);
+    while (lapic[ICRLO] & DELIVS) asm volatile("pause");
+
+    /* Enable interrupts on the APIC (but not on the processor). */
+    lapicw(TPR, 0);
+
+    if (!lapic_timer_freq) lapic_timer_calibrate();
+}
+
+/* Make local APIC timer fire once in ns nanoseconds */
+static void
+lapic_timer_oneshot(uint64_t ns) {
+    uint64_t count = MAX(lapic_timer_freq * ns / 1000000000, 1);
+
+    lapicw(TDCR, X16);
+    lapicw(TIMER, IRQ_OFFSET + IRQ_LAPIC_TIMER);
+    lapicw(TICR, MIN(count, ~0U));
+}
+
+static void
+lapic_timer_stop(void) {
+    lapicw(TICR, 0);
+}
+
+/* Per-CPU timer driving the scheduler on APs */
+struct Timer timer_lapic = {
+        .timer_name = "lapic",
+        .handle_interrupts = lapic_eoi,
+        .set_oneshot = lapic_timer_oneshot,
+        .stop = lapic_timer_stop,
+};
+
+/* Acknowledge interrupt. */
+void
+lapic_eoi(void) {
+    if (lapic) lapicw(EOI, 0);
+}
+
+/* Start additional processor running entry code at addr.
+ * See Appendix B of MultiProcessor Specification. */
+void
+lapic_startap(uint8_t apicid, physaddr_t addr) {
+    /* "Universal startup algorithm."
+     * Send INIT (level-triggered) interrupt to reset other CPU. */
+    lapicw(ICRHI, apicid << 24);
+    lapicw(ICRLO, INIT | LEVEL | ASSERT);
+    microdelay(200);
+    lapicw(ICRLO, INIT | LEVEL);
+    microdelay(100); /* should be 10ms, but too slow in Bochs! */
+
+    /* Send startup IPI (twice!) to enter code.
+     * Regular hardware is supposed to only accept a STARTUP
+     * when it is in the halted state due to an INIT.  So the second
+     * should be ignored, but it is part of the official Intel algorithm. */
+    for (int i = 0; i < 2; i++) {
+        lapicw(ICRHI, apicid << 24);
+        lapicw(ICRLO, STARTUP | (addr >> 12));
+        microdelay(200);
+    }
+}
+
+/* Send fixed interrupt with the given vector to cpu */
+void
+lapic_ipi(struct CpuInfo *cpu, int vector) {
+    lapicw(ICRHI, cpu->cpu_apicid << 24);
+    lapicw(ICRLO, FIXED | vector);
+    while (lapic[ICRLO] & DELIVS) asm volatile("pause");
+}
@@ -0,0 +1,53 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_LIST_H
+#define JOS_KERN_LIST_H
+#ifndef JOS_KERNEL
+#error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+/* Intrusive doubly-linked circular lists.
+ * Empty list (and unlinked element) points to itself */
+
+/* Get pointer to structure of given type containing list element */
+#define LIST_ENTRY(li, type, member) \
+    ((type *)((uint8_t *)(li) - offsetof(type, member)))
+
+inline static bool __attribute__((always_inline))
+list_empty(struct List *list) {
+    return list->next == list;
+}
+
+inline static void __attribute__((always_inline))
+list_init(struct List *list) {
+    list->next = list->prev = list;
+}
+
+/*
+ * Appends list element 'new' after list element 'list'
+ */
+inline static void __attribute__((always_inline))
+list_append(struct List *list, struct List *new) {
+    new->next = list->next;
+    new->prev = list;
+    list->next->prev = new;
+    list->next = new;
+}
+
+/*
+ * Deletes list element from list.
+ * NOTE: Use list_init() on deleted List element
+ */
+inline static struct List *__attribute__((always_inline))
+list_del(struct List *list) {
+    list->prev->next = list->next;
+    list->next->prev = list->prev;
+    list_init(list);
+
+    return list;
+}
+
+#endif /* !JOS_KERN_LIST_H */
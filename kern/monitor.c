@@ -16,6 +16,7 @@
 #include <kern/timer.h>
 #include <kern/env.h>
 #include <kern/pmap.h>
+#include <kern/syscall.h>
 #include <kern/trap.h>
 
 #define WHITESPACE "\t\r\n "
@@ -33,6 +34,10 @@ int mon_frequency(int argc, char **argv, struct Trapframe *tf);
 int mon_memory(int argc, char **argv, struct Trapframe *tf);
 int mon_pagetable(int argc, char **argv, struct Trapframe *tf);
 int mon_virt(int argc, char **argv, struct Trapframe *tf);
+int mon_cpus(int argc, char **argv, struct Trapframe *tf);
+int mon_sysstat(int argc, char **argv, struct Trapframe *tf);
+int mon_tlbstat(int argc, char **argv, struct Trapframe *tf);
+int mon_magstat(int argc, char **argv, struct Trapframe *tf);
 
 struct Command {
     const char *name;
@@ -53,6 +58,10 @@ static struct Command commands[] = {
         {"memory", "Display allocated memory pages", mon_memory},
         {"pagetable", "Display current page table", mon_pagetable},
         {"virt", "Display virtual memory tree", mon_virt},
+        {"cpus", "Display CPUs and their idle time", mon_cpus},
+        {"sysstat", "Display system call and trap statistics ('sysstat reset' clears them)", mon_sysstat},
+        {"tlbstat", "Display TLB invalidation statistics ('tlbstat reset', 'tlbstat ceiling N')", mon_tlbstat},
+        {"magstat", "Display page magazine and zeroed pool statistics ('magstat reset' clears them)", mon_magstat},
 };
 #define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
 
@@ -149,6 +158,137 @@ mon_virt(int argc, char **argv, struct Trapframe *tf) {
     return 0;
 }
 
+int
+mon_cpus(int argc, char **argv, struct Trapframe *tf) {
+    uint64_t freq = tsc_calibrate();
+    for (struct CpuInfo *cpu = cpus; cpu < cpus + ncpu; cpu++) {
+        cprintf("CPU %d%s: %s, idle %lu ms, %u queued\n", cpu->cpu_apicid,
+                cpu == bootcpu ? " (boot)" : "",
+                cpu->cpu_status == CPU_HALTED ? "halted" :
+                cpu->cpu_status == CPU_STARTED ? "running" : "unused",
+                (unsigned long)(cpu->cpu_idle_tsc / (freq / 1000)), cpu->cpu_nrunnable);
+    }
+    return 0;
+}
+
+static const char *const syscallnames[NSYSCALLS] = {
+        [SYS_cputs] = "cputs",
+        [SYS_cgetc] = "cgetc",
+        [SYS_getenvid] = "getenvid",
+        [SYS_env_destroy] = "env_destroy",
+        [SYS_alloc_region] = "alloc_region",
+        [SYS_map_region] = "map_region",
+        [SYS_map_physical_region] = "map_physical_region",
+        [SYS_unmap_region] = "unmap_region",
+        [SYS_region_refs] = "region_refs",
+        [SYS_exofork] = "exofork",
+        [SYS_env_set_status] = "env_set_status",
+        [SYS_env_set_trapframe] = "env_set_trapframe",
+        [SYS_env_set_pgfault_upcall] = "env_set_pgfault_upcall",
+        [SYS_yield] = "yield",
+        [SYS_ipc_try_send] = "ipc_try_send",
+        [SYS_ipc_recv] = "ipc_recv",
+        [SYS_ipc_send] = "ipc_send",
+        [SYS_ipc_call] = "ipc_call",
+        [SYS_ipc_reply_wait] = "ipc_reply_wait",
+        [SYS_gettime] = "gettime",
+        [SYS_env_set_priority] = "env_set_priority",
+        [SYS_env_wait] = "env_wait",
+        [SYS_futex_wait] = "futex_wait",
+        [SYS_futex_wake] = "futex_wake",
+        [SYS_batch] = "batch",
+        [SYS_env_set_fault_around] = "env_set_fault_around",
+        [SYS_env_exit] = "env_exit",
+};
+
+int
+mon_sysstat(int argc, char **argv, struct Trapframe *tf) {
+    if (!sysstat) {
+        cprintf("No statistics yet\n");
+        return 0;
+    }
+    if (argc > 1 && !strcmp(argv[1], "reset")) {
+        memset(sysstat, 0, sizeof(*sysstat));
+        return 0;
+    }
+
+    cprintf("%-24s %10s %12s  latency histogram (log2 ticks: count)\n", "syscall", "count", "avg ticks");
+    for (int i = 0; i < NSYSCALLS; i++) {
+        struct SyscallStat *stat = &sysstat->st_syscalls[i];
+        if (!stat->ss_count) continue;
+
+        uint64_t nreturned = 0;
+        for (int j = 0; j < SYSSTAT_NBUCKETS; j++)
+            nreturned += stat->ss_hist[j];
+
+        cprintf("%-24s %10lu %12lu ", syscallnames[i] ? syscallnames[i] : "?",
+                (unsigned long)stat->ss_count, (unsigned long)(nreturned ? stat->ss_cycles / nreturned : 0));
+        for (int j = 0; j < SYSSTAT_NBUCKETS; j++)
+            if (stat->ss_hist[j]) cprintf(" %d:%lu", j + SYSSTAT_SHIFT, (unsigned long)stat->ss_hist[j]);
+        cprintf("\n");
+    }
+
+    cprintf("%-24s %10s\n", "trap", "count");
+    for (int i = 0; i < SYSSTAT_NTRAPS; i++) {
+        if (sysstat->st_traps[i])
+            cprintf("%3d %-20s %10lu\n", i, trapname(i), (unsigned long)sysstat->st_traps[i]);
+    }
+    return 0;
+}
+
+int
+mon_tlbstat(int argc, char **argv, struct Trapframe *tf) {
+    if (argc > 1 && !strcmp(argv[1], "reset")) {
+        memset(&tlbstat, 0, sizeof(tlbstat));
+        return 0;
+    }
+    if (argc > 2 && !strcmp(argv[1], "ceiling")) {
+        tlb_flush_ceiling = strtol(argv[2], NULL, 0);
+        return 0;
+    }
+
+    cprintf("invlpg per 4KB page: %lu ranges\n", (unsigned long)tlbstat.ts_page);
+    cprintf("invlpg per large page: %lu ranges\n", (unsigned long)tlbstat.ts_large);
+    cprintf("invlpg executed: %lu\n", (unsigned long)tlbstat.ts_invlpg);
+    cprintf("full flushes: %lu (ceiling %zu entries)\n", (unsigned long)tlbstat.ts_full, tlb_flush_ceiling);
+    cprintf("shootdown IPIs: %lu\n", (unsigned long)tlbstat.ts_shootdown);
+    return 0;
+}
+
+int
+mon_magstat(int argc, char **argv, struct Trapframe *tf) {
+    static const char *const sizes[NMAGAZINES] = {"4K", "2M"};
+
+    if (argc > 1 && !strcmp(argv[1], "reset")) {
+        for (int cpu = 0; cpu < NCPU; cpu++) {
+            for (int i = 0; i < NMAGAZINES; i++) {
+                struct PageMagazine *mag = &magazines[cpu][i];
+                mag->pm_hits = mag->pm_misses = mag->pm_refills = mag->pm_drains = 0;
+            }
+        }
+        for (int i = 0; i < NMAGAZINES; i++)
+            zero_pools[i].zp_hits = zero_pools[i].zp_misses = 0;
+        return 0;
+    }
+
+    cprintf("CPU SIZE  CACHED       HITS     MISSES    REFILLS     DRAINS\n");
+    for (int cpu = 0; cpu < ncpu; cpu++) {
+        for (int i = 0; i < NMAGAZINES; i++) {
+            struct PageMagazine *mag = &magazines[cpu][i];
+            cprintf("%3d %4s %7zu %10lu %10lu %10lu %10lu\n", cpu, sizes[i], mag->pm_count,
+                    (unsigned long)mag->pm_hits, (unsigned long)mag->pm_misses,
+                    (unsigned long)mag->pm_refills, (unsigned long)mag->pm_drains);
+        }
+    }
+
+    for (int i = 0; i < NMAGAZINES; i++) {
+        cprintf("zeroed %s pool: %zu pages, %lu hits, %lu misses\n", sizes[i], zero_pools[i].zp_count,
+                (unsigned long)zero_pools[i].zp_hits, (unsigned long)zero_pools[i].zp_misses);
+    }
+    cprintf("huge pages collapsed: %lu\n", (unsigned long)huge_collapsed);
+    return 0;
+}
+
 // LAB 4: Your code here
 int
 mon_dumpcmos(int argc, char **argv, struct Trapframe *tf) {
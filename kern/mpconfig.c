@@ -0,0 +1,75 @@
+/* Search for and parse the multiprocessor configuration table
+ * (ACPI Multiple APIC Description Table, MADT) */
+
+#include <inc/types.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+#include <kern/timer.h>
+#include <kern/traceopt.h>
+
+#define MSR_APIC_BASE 0x1B
+
+struct CpuInfo cpus[NCPU];
+struct CpuInfo *bootcpu;
+int ncpu;
+
+/* Physical address of the local APIC */
+physaddr_t lapicaddr;
+
+/* Per-CPU kernel stacks (BSP uses bootstack and pfstack) */
+unsigned char percpu_kstacks[NCPU][KERN_STACK_SIZE] __attribute__((aligned(PAGE_SIZE)));
+unsigned char percpu_pfstacks[NCPU][KERN_PF_STACK_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+/* Enumerates processors listed in MADT. The BSP always gets index 0
+ * since it had been running on CPU 0 kernel stack before APs are known */
+void
+mp_init(void) {
+    bootcpu = &cpus[0];
+    bootcpu->cpu_status = CPU_STARTED;
+    ncpu = 1;
+
+    lapicaddr = rdmsr(MSR_APIC_BASE) & ~(uint64_t)(PAGE_SIZE - 1);
+
+    MADT *madt = get_madt();
+    if (!madt) {
+        cprintf("SMP: MADT is absent, running on single CPU\n");
+        return;
+    }
+
+    lapicaddr = madt->LocalApicAddress;
+
+    uint8_t *start = madt->Entries;
+    uint8_t *end = (uint8_t *)madt + madt->h.Length;
+    for (uint8_t *entry = start; entry < end && ((MADTEntry *)entry)->Length;
+         entry += ((MADTEntry *)entry)->Length) {
+        if (((MADTEntry *)entry)->Type == MADT_LAPIC_OVERRIDE)
+            lapicaddr = ((MADTLocalApicOverride *)entry)->Address;
+    }
+
+    /* Map local APIC to find out BSP APIC ID */
+    lapic_init();
+
+    for (uint8_t *entry = start; entry < end && ((MADTEntry *)entry)->Length;
+         entry += ((MADTEntry *)entry)->Length) {
+        if (((MADTEntry *)entry)->Type != MADT_LAPIC) continue;
+
+        MADTLocalApic *la = (MADTLocalApic *)entry;
+        if (!(la->Flags & (MADT_LAPIC_ENABLED | MADT_LAPIC_ONLINE_CAPABLE)) ||
+            la->ApicId == bootcpu->cpu_apicid) continue;
+
+        if (ncpu < NCPU) {
+            cpus[ncpu++].cpu_apicid = la->ApicId;
+        } else {
+            cprintf("SMP: too many CPUs, CPU %d disabled\n", la->ApicId);
+        }
+    }
+
+    if (trace_init) cprintf("SMP: CPU %d found %d CPU(s)\n", bootcpu->cpu_apicid, ncpu);
+}
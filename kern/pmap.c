@@ -9,6 +9,7 @@
 
 #include <kern/env.h>
 #include <kern/kclock.h>
+#include <kern/list.h>
 #include <kern/pmap.h>
 #include <kern/traceopt.h>
 #include <kern/trap.h>
@@ -21,8 +22,16 @@
  * by struct Page
  */
 
-/* for O(1) page allocation */
-static struct List free_classes[MAX_CLASS];
+/* for O(1) page allocation: free pages of every class are kept
+ * in separate lists for blocks starting below and above BOOT_MEM_SIZE,
+ * bits of free_class_mask are set for non-empty lists */
+enum {
+    FREE_BOOTMEM,
+    FREE_HIGHMEM,
+    FREE_NZONES,
+};
+static struct List free_classes[FREE_NZONES][MAX_CLASS];
+static uint64_t free_class_mask[FREE_NZONES];
 /* List of descriptor pools */
 static struct PagePool *first_pool;
 /* List of free descriptors */
@@ -32,8 +41,6 @@ static size_t free_desc_count;
 size_t max_memory_map_addr;
 /* Kernel address space */
 struct AddressSpace kspace;
-/* Currently active address spcae */
-struct AddressSpace *current_space;
 /* Root node of physical memory tree */
 struct Page root;
 /* Top address for page pools mappings */
@@ -44,6 +51,18 @@ static bool nx_supported;
 /* 1GB pages are supported */
 static bool has_1gb_pages;
 
+/* PCIDs are supported by CPU */
+static bool pcid_supported;
+/* Address spaces are tagged with PCIDs (CR4_PCIDE is set) */
+bool pcid_enabled;
+/* Number of PCIDs */
+#define NPCID (CR3_PCID + 1)
+/* PCIDs are handed out sequentially, when they run out a new
+ * generation starts and spaces get new ones when loaded next time.
+ * PCID 0 is left for CR3 values loaded at boot */
+static uint64_t pcid_generation = 1;
+static uint16_t pcid_next = 1;
+
 /* Kernel executable end virtual address */
 extern char end[];
 extern char pfstacktop[], pfstack[];
@@ -72,43 +91,8 @@ extern char pfstacktop[], pfstack[];
 #define assert_physical(n) ({ if (trace_memory_more) _assert_root(__FILE__, __LINE__, n, 1); assert(((n)->state & NODE_TYPE_MASK) >= PARTIAL_NODE); })
 #define assert_virtual(n)  ({if (trace_memory_more) _assert_root(__FILE__, __LINE__, n, 0); assert(((n)->state & NODE_TYPE_MASK) < PARTIAL_NODE); })
 
-inline static bool __attribute__((always_inline))
-list_empty(struct List *list) {
-    return list->next == list;
-}
-
-inline static void __attribute__((always_inline))
-list_init(struct List *list) {
-    list->next = list->prev = list;
-}
-
-/*
- * Appends list element 'new' after list element 'list'
- */
-inline static void __attribute__((always_inline))
-list_append(struct List *list, struct List *new) {
-    // LAB 6: Your code here
-    new->next = list->next;
-    new->prev = list;
-    list->next->prev = new;
-    list->next = new;
-}
-
-/*
- * Deletes list element from list.
- * NOTE: Use list_init() on deleted List element
- */
-inline static struct List *__attribute__((always_inline))
-list_del(struct List *list) {
-    // LAB 6: Your code here
-    list->prev->next = list->next;
-    list->next->prev = list->prev;
-    list_init(list);
-
-    return list;
-}
-
 static struct Page *alloc_page(int class, int flags);
+static bool magazine_put(struct Page *page);
 
 void
 ensure_free_desc(size_t count) {
@@ -150,12 +134,36 @@ _assert_root(const char *file, int line, struct Page *p, bool phy) {
         _panic(file, line, "Page %p (phy %p) should%s be physical\n", p, (void *)PADDR(p), phy ? "" : "n't");
 }
 
+/* Free list physical page belongs to */
+static struct List *
+free_list(struct Page *page, int *zone) {
+    *zone = page2pa(page) < BOOT_MEM_SIZE ? FREE_BOOTMEM : FREE_HIGHMEM;
+    return &free_classes[*zone][page->class];
+}
+
+static void
+free_list_add(struct Page *page) {
+    int zone;
+    list_append(free_list(page, &zone), (struct List *)page);
+    free_class_mask[zone] |= 1ULL << page->class;
+}
+
+/* Removes page from its free list (if it is there) */
+static void
+free_list_del(struct Page *page) {
+    int zone;
+    struct List *list = free_list(page, &zone);
+    list_del((struct List *)page);
+    if (list_empty(list)) free_class_mask[zone] &= ~(1ULL << page->class);
+}
+
 static void
 free_desc_rec(struct Page *p) {
     while (p) {
         assert(!p->refc);
         free_desc_rec(p->right);
         struct Page *tmp = p->left;
+        free_list_del(p);
         free_descriptor(p);
         p = tmp;
     }
@@ -234,8 +242,8 @@ page_lookup(struct Page *hint, uintptr_t addr, int class, enum PageState type, b
                 /* Recalculate free lists for allocatable page */
                 struct Page *other = !right ? node->right : node->left;
                 assert(other->state == ALLOCATABLE_NODE);
-                list_del((struct List *)node);
-                list_append(&free_classes[node->class - 1], (struct List *)other);
+                free_list_del(node);
+                free_list_add(other);
             }
 
             if (type != PARTIAL_NODE && node->state != type)
@@ -256,11 +264,11 @@ page_lookup(struct Page *hint, uintptr_t addr, int class, enum PageState type, b
         free_desc_rec(node->left);
         free_desc_rec(node->right);
         node->left = node->right = NULL;
-        list_del((struct List *)node);
+        free_list_del(node);
 
         /* We cannot change RESERVED_NODE memory to ALLOCATABLE_NODE */
         if (type != PARTIAL_NODE && node->state != RESERVED_NODE) node->state = type;
-        if (node->state == ALLOCATABLE_NODE) list_append(&free_classes[node->class], (struct List *)node);
+        if (node->state == ALLOCATABLE_NODE) free_list_add(node);
 
         if (trace_memory) cprintf("Attaching page (%x) at %p class=%d\n", node->state, (void *)page2pa(node), (int)node->class);
     }
@@ -279,15 +287,16 @@ page_ref(struct Page *node) {
      * so need to reference them recursively
      * when refc transitions from 0 to 1 */
     if (!node->refc++) {
-        list_del((struct List *)node);
-        list_init((struct List *)node);
+        free_list_del(node);
         page_ref(node->left);
         page_ref(node->right);
     }
 }
 
+/* Drop reference to the page returning it to the
+ * free lists when it was the last one */
 static void
-page_unref(struct Page *page) {
+page_release(struct Page *page) {
     if (!page) return;
     assert_physical(page);
     assert(page->refc);
@@ -297,8 +306,8 @@ page_unref(struct Page *page) {
      * to prevent double frees */
 
     if (page->refc == 1) {
-        page_unref(page->left);
-        page_unref(page->right);
+        page_release(page->left);
+        page_release(page->right);
     }
 
     page->refc--;
@@ -311,23 +320,25 @@ page_unref(struct Page *page) {
             if (par->state == page->state &&
                 PAGE_IS_FREE(par->left) &&
                 PAGE_IS_FREE(par->right)) {
+                free_list_del(par->left);
                 free_descriptor(par->left);
                 par->left = NULL;
 
+                free_list_del(par->right);
                 free_descriptor(par->right);
                 par->right = NULL;
 
                 if (par->state == ALLOCATABLE_NODE) {
                     assert(list_empty((struct List *)par));
-                    list_append(&free_classes[par->class], (struct List *)par);
+                    free_list_add(par);
                 }
                 page = par;
             } else
                 break;
         }
-        list_del((struct List *)page);
+        free_list_del(page);
         if (page->state == ALLOCATABLE_NODE)
-            list_append(&free_classes[page->class], (struct List *)page);
+            free_list_add(page);
 
 #if SANITIZE_SHADOW_BASE
         if (current_space) {
@@ -337,6 +348,19 @@ page_unref(struct Page *page) {
     }
 }
 
+static void
+page_unref(struct Page *page) {
+    if (!page) return;
+    assert_physical(page);
+    assert(page->refc);
+
+    /* Last reference to the page of common size
+     * is kept by the magazine of this CPU */
+    if (page->refc == 1 && magazine_put(page)) return;
+
+    page_release(page);
+}
+
 void
 alloc_virtual_child(struct Page *parent, struct Page **dst) {
     assert_virtual(parent);
@@ -571,8 +595,10 @@ check_physical_tree(struct Page *page) {
     if (!page->refc) {
         assert(page->head.next && page->head.prev);
         if (!list_empty((struct List *)page)) {
-            for (struct List *n = page->head.next;
-                 n != &free_classes[page->class]; n = n->next) {
+            int zone;
+            struct List *list = free_list(page, &zone);
+            assert(free_class_mask[zone] & (1ULL << page->class));
+            for (struct List *n = page->head.next; n != list; n = n->next) {
                 assert(n != &page->head);
             }
         }
@@ -640,13 +666,15 @@ dump_memory_lists(void) {
     // LAB 6: Your code here
     for (size_t i = 0; i < MAX_CLASS; i++) {
         cprintf("Class %zu:\n", i);
-        struct List *list = &free_classes[i];
-        struct List *node = list->next;
-
-        while (node != list) {
-            struct Page *page = (struct Page *)node;
-            cprintf("%016lx - %016llx \n", page2pa(page), page2pa(page) + CLASS_MASK(i));
-            node = node->next;
+        for (int zone = 0; zone < FREE_NZONES; zone++) {
+            struct List *list = &free_classes[zone][i];
+            struct List *node = list->next;
+
+            while (node != list) {
+                struct Page *page = (struct Page *)node;
+                cprintf("%016lx - %016llx \n", page2pa(page), page2pa(page) + CLASS_MASK(i));
+                node = node->next;
+            }
         }
     }
 }
@@ -773,48 +801,155 @@ alloc_fill_pt(pte_t *dst, pte_t base, size_t step, size_t i0, size_t i1) {
     return 0;
 }
 
-/* Copy physical page contents to some virtual address
- *
- * To copy physical address you can use linear
- * physical memory mapping to KERN_BASE_ADDR
- * (via KADDR).
- *
- * You need temporarily switch to dst address space and
- * restore previous address space afterwards.
- *
- * Don't forget to disable write protection, since
- * destination page might be read-only
+/* Copy size bytes (a multiple of page size) between
+ * physical pages mapped linearly at KERN_BASE_ADDR.
+ * Huge pages are written with non-temporal stores,
+ * they would evict the whole cache otherwise */
+static void
+copy_page_phys(void *dst, const void *src, size_t size) {
+    size_t count = size / sizeof(uint64_t);
+
+    if (size < HUGE_PAGE_SIZE) {
+        asm volatile("rep movsq"
+                     : "+D"(dst), "+S"(src), "+c"(count)::"memory");
+        return;
+    }
+
+    uint64_t *d = dst;
+    const uint64_t *s = src;
+    for (size_t i = 0; i < count; i++)
+        asm volatile("movnti %1, %0"
+                     : "=m"(d[i])
+                     : "r"(s[i]));
+    asm volatile("sfence" ::
+                         : "memory");
+}
+
+/* Fill size bytes (a multiple of page size) at KERN_BASE_ADDR
+ * with zeroes bypassing the cache with non-temporal stores */
+static void
+zero_page_phys(void *dst, size_t size) {
+    uint64_t *d = dst;
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+        asm volatile("movnti %1, %0"
+                     : "=m"(d[i])
+                     : "r"(0UL));
+    asm volatile("sfence" ::
+                         : "memory");
+}
+
+/* Copy physical page contents to the page(s) mapped
+ * at va in dst, which has just been allocated.
  *
- * TIP: switch_address_space, nosan_memcpy, and set_wp are used here
- */
+ * Both sides are accessed via linear physical memory
+ * mapping to KERN_BASE_ADDR (KADDR), so neither the address
+ * space nor write protection has to be switched.
+ * Destination can be composed of smaller pages
+ * (see alloc_composite_page()) */
 static void
 memcpy_page(struct AddressSpace *dst, uintptr_t va, struct Page *page) {
-    assert(current_space);
     assert(dst);
 
     // LAB 7: Your code here
-    struct AddressSpace *old_space = switch_address_space(dst);
+    uint8_t *src = KADDR(page2pa(page));
+    size_t size = CLASS_SIZE(page->class);
+
+    for (size_t offset = 0; offset < size;) {
+        struct Page *node = page_lookup_virtual(dst->root, va + offset, 0, LOOKUP_PRESERVE);
+        assert(node && node->phy);
+        assert(!((va + offset) & CLASS_MASK(node->phy->class)));
+
+        size_t chunk = MIN((size_t)CLASS_SIZE(node->phy->class), size - offset);
+        copy_page_phys(KADDR(page2pa(node->phy)), src + offset, chunk);
+        offset += chunk;
+    }
+}
+
+/* Ranges spanning more TLB entries than this are invalidated
+ * by flushing the whole TLB instead of invlpg per entry */
+size_t tlb_flush_ceiling = 32;
+/* TLB invalidation statistics (see mon_tlbstat()) */
+struct TlbStat tlbstat;
 
-    set_wp(false);
-    nosan_memcpy((void *)va, KADDR(page2pa(page)), CLASS_SIZE(page->class));
-    set_wp(true);
+/* Class of hardware pages that entries [i0, i1) of the page table
+ * level with large pages of the given class map: the class itself
+ * if all present entries are large pages and 0 (4KB pages) otherwise */
+static int
+tlb_entries_class(pte_t *table, size_t i0, size_t i1, int class) {
+    for (size_t i = i0; i < i1; i++)
+        if ((table[i] & (PTE_P | PTE_PS)) == PTE_P) return 0;
+    return class;
+}
 
-    switch_address_space(old_space);
+/* Flush TLB of this CPU if the holder of
+ * the big kernel lock has requested it (see tlb_shootdown()) */
+void
+tlb_shootdown_serve(void) {
+    struct CpuInfo *cpu = thiscpu;
+    if (!cpu->cpu_tlb_shootdown) return;
+
+    /* Reloading CR3 drops entries of the loaded PCID */
+    lcr3(rcr3());
+    cpu->cpu_tlb_shootdown = 0;
 }
 
+/* Flush TLBs of other CPUs that have spc loaded and wait for them,
+ * so that pages unmapped from it can be reused right away.
+ * These CPUs run environments or wait for the big kernel lock
+ * (see lock_kernel()), so they can't switch spaces meanwhile */
 static void
-tlb_invalidate_range(struct AddressSpace *spc, uintptr_t start, uintptr_t end) {
-    if (current_space == spc || !current_space) {
-        /* If we need to invalidate a lot of memory, just flush whole cache */
-        if (start - end > 512 * GB)
-            lcr3(rcr3());
-        else {
-            while (start < end) {
-                invlpg((void *)start);
-                start += PAGE_SIZE;
-            }
-        }
+tlb_shootdown(struct AddressSpace *spc) {
+    struct CpuInfo *self = thiscpu;
+    for (struct CpuInfo *cpu = cpus; cpu < cpus + ncpu; cpu++) {
+        if (cpu == self || cpu->cpu_space != spc) continue;
+
+        cpu->cpu_tlb_shootdown = 1;
+        lapic_ipi(cpu, IRQ_OFFSET + IRQ_TLB_SHOOTDOWN);
+        tlbstat.ts_shootdown++;
     }
+
+    for (struct CpuInfo *cpu = cpus; cpu < cpus + ncpu; cpu++)
+        while (cpu->cpu_tlb_shootdown) asm volatile("pause");
+}
+
+/* Invalidate TLB entries of [start, end) mapped by
+ * hardware pages of the given class (or smaller ones) */
+static void
+tlb_invalidate_range(struct AddressSpace *spc, uintptr_t start, uintptr_t end, int class) {
+    /* Other PCIDs are not flushed right away, stale entries are
+     * dropped when the space is loaded next time. CPUs running
+     * the space right now are flushed with IPIs.
+     * Kernel mappings are shared by all address spaces */
+    if (spc == &kspace) {
+        for (struct CpuInfo *cpu = cpus; cpu < cpus + ncpu; cpu++)
+            cpu->cpu_tlb_stale = 1;
+    } else {
+        spc->tlb_stale = ~0U;
+        if (current_space == spc) spc->tlb_stale &= ~(1U << cpunum());
+        tlb_shootdown(spc);
+    }
+
+    if (current_space != spc && current_space && spc != &kspace) return;
+
+    /* One invlpg drops the whole entry of a large page */
+    start = ROUNDDOWN(start, CLASS_SIZE(class));
+    size_t count = (ROUNDUP(end, CLASS_SIZE(class)) - start) >> (class + CLASS_BASE);
+
+    /* If we need to invalidate a lot of memory, just flush whole cache */
+    if (count > tlb_flush_ceiling) {
+        tlbstat.ts_full++;
+        lcr3(rcr3());
+        return;
+    }
+
+    if (class)
+        tlbstat.ts_large++;
+    else
+        tlbstat.ts_page++;
+    tlbstat.ts_invlpg += count;
+
+    for (; count--; start += CLASS_SIZE(class))
+        invlpg((void *)start);
 }
 
 static void
@@ -832,6 +967,7 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
 
     uintptr_t end = addr + CLASS_SIZE(class);
     uintptr_t inval_start = addr, inval_end = end;
+    int inval_class = 0;
 
     size_t pml4i0 = PML4_INDEX(addr), pml4i1 = PML4_INDEX(end);
     if (class >= 27) {
@@ -852,6 +988,7 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
      * is >= than 1*GB */
 
     if (class >= 18) {
+        inval_class = tlb_entries_class(pdp, pdpi0, pdpi1, 18);
         remove_pt(pdp, addr, 1 * GB, pdpi0, pdpi1);
         goto finish;
     }
@@ -868,8 +1005,10 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
         assert(!res);
         pde_t *pd = KADDR(PTE_ADDR(pdp[pdpi0]));
         res = alloc_fill_pt(pd, old & ~PTE_PS, 2 * MB, 0, PT_ENTRY_COUNT);
+        /* Only the entry of the old 1GB page can be cached */
         inval_start = ROUNDDOWN(inval_start, 1 * GB);
         inval_end = ROUNDUP(inval_end, 1 * GB);
+        inval_class = 18;
         assert(!res);
     }
     pde_t *pd = KADDR(PTE_ADDR(pdp[pdpi0]));
@@ -888,6 +1027,7 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
     if (pdi0 > pdi1) pdi1 = PD_ENTRY_COUNT;
 
     if (class >= 9) { // larger or equal
+        if (inval_class < 18) inval_class = tlb_entries_class(pd, pdi0, pdi1, 9);
         remove_pt(pd, addr, 2 * MB, pdi0, pdi1);
         goto finish;
     }
@@ -912,8 +1052,11 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
         assert(!res);
         pde_t *pt = KADDR(PTE_ADDR(pd[pdi0]));
         res = alloc_fill_pt(pt, old & ~PTE_PS, 4 * KB, 0, PT_ENTRY_COUNT);
-        inval_start = ROUNDDOWN(inval_start, 2 * MB);
-        inval_end = ROUNDUP(inval_end, 2 * MB);
+        if (inval_class < 18) {
+            inval_start = ROUNDDOWN(inval_start, 2 * MB);
+            inval_end = ROUNDUP(inval_end, 2 * MB);
+            inval_class = 9;
+        }
         assert(!res);
     }
     pte_t *pt = KADDR(PTE_ADDR(pd[pdi0]));
@@ -930,7 +1073,7 @@ unmap_page(struct AddressSpace *spc, uintptr_t addr, int class) {
     assert(0);
 
 finish:
-    tlb_invalidate_range(spc, inval_start, inval_end);
+    tlb_invalidate_range(spc, inval_start, inval_end, inval_class);
 }
 
 static int
@@ -1080,31 +1223,28 @@ unmap_region(struct AddressSpace *dspace, uintptr_t dst, uintptr_t size) {
     }
 }
 
-/* Just allocate page, without mapping it */
+/* Allocate page from the free lists */
 static struct Page *
-alloc_page(int class, int flags) {
-    struct List *li = NULL;
-    struct Page *peer = NULL;
-
-    if (flags & ALLOC_POOL) flags |= ALLOC_BOOTMEM;
-#ifndef SANITIZE_SHADOW_BASE
-    if (current_space) flags &= ~ALLOC_BOOTMEM;
-#endif
-
-    /* Find page that is not smaller than requested
-     * (Pool memory should also be within BOOT_MEM_SIZE) */
-    for (int pclass = class; pclass < MAX_CLASS; pclass++, li = NULL) {
-        for (li = free_classes[pclass].next; li != &free_classes[pclass]; li = li->next) {
-            peer = (struct Page *)li;
-            assert(peer->state == ALLOCATABLE_NODE);
-            assert_physical(peer);
-            if (!(flags & ALLOC_BOOTMEM) || page2pa(peer) + CLASS_SIZE(class) < BOOT_MEM_SIZE) goto found;
-        }
-    }
-    return NULL;
-
-found:
-    list_del(li);
+buddy_alloc_page(int class, int flags) {
+    /* Find the smallest page that is not smaller than requested
+     * (Pool memory should also be within BOOT_MEM_SIZE).
+     * Free blocks starting below BOOT_MEM_SIZE are aligned to
+     * their size, so they lie within it unless they are larger.
+     * Memory above it is preferred when either fits */
+    if ((flags & ALLOC_BOOTMEM) && CLASS_SIZE(class) > BOOT_MEM_SIZE) return NULL;
+    uint64_t fit = ~((1ULL << class) - 1);
+    uint64_t boot = free_class_mask[FREE_BOOTMEM] & fit;
+    uint64_t high = flags & ALLOC_BOOTMEM ? 0 : free_class_mask[FREE_HIGHMEM] & fit;
+    if (!boot && !high) return NULL;
+
+    int pclass = __builtin_ctzll(boot | high);
+    int zone = high & (1ULL << pclass) ? FREE_HIGHMEM : FREE_BOOTMEM;
+    struct List *li = free_classes[zone][pclass].next;
+    struct Page *peer = (struct Page *)li;
+    assert(li != &free_classes[zone][pclass]);
+    assert(peer->state == ALLOCATABLE_NODE);
+    assert_physical(peer);
+    free_list_del(peer);
 
     size_t ndesc = 0;
     static bool allocating_pool;
@@ -1148,6 +1288,178 @@ found:
     return new;
 }
 
+/* Per-CPU magazines: stacks of recently freed pages
+ * of the sizes page faults allocate most often (4K and 2M).
+ * Pages in magazines are referenced by them, so that
+ * they are not merged back into the physical tree.
+ * Magazines are refilled from and drained to the free lists
+ * in batches, the oldest (coldest) pages are drained first */
+struct PageMagazine magazines[NCPU][NMAGAZINES];
+
+static const struct {
+    int class;
+    size_t capacity;
+    size_t batch;
+} magazine_sizes[NMAGAZINES] = {
+        {0, 64, 16},
+        {9, 4, 2},
+};
+
+static int
+magazine_index(int class) {
+    for (int i = 0; i < NMAGAZINES; i++)
+        if (magazine_sizes[i].class == class) return i;
+    return -1;
+}
+
+/* Release count oldest pages of the magazine */
+static void
+magazine_drain(struct PageMagazine *mag, size_t count) {
+    count = MIN(count, mag->pm_count);
+    for (size_t i = 0; i < count; i++)
+        page_release(mag->pm_pages[i]);
+    memmove(mag->pm_pages, mag->pm_pages + count, (mag->pm_count - count) * sizeof(*mag->pm_pages));
+    mag->pm_count -= count;
+    mag->pm_drains++;
+}
+
+/* Pools of pages zeroed in advance by idle CPUs (zero_pool_fill())
+ * for lazily zero-filled memory (see force_alloc_page()).
+ * Sizes are the same as the ones of magazines, pages are
+ * referenced by the pool like they are by magazines */
+struct ZeroPool zero_pools[NMAGAZINES];
+
+static const size_t zero_pool_capacity[NMAGAZINES] = {ZERO_POOL_SIZE, 4};
+
+/* Drain magazines of all CPUs and zeroed
+ * page pools when memory runs out */
+static bool
+magazine_drain_all(void) {
+    bool drained = 0;
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        for (int i = 0; i < NMAGAZINES; i++) {
+            if (!magazines[cpu][i].pm_count) continue;
+            magazine_drain(&magazines[cpu][i], magazines[cpu][i].pm_count);
+            drained = 1;
+        }
+    }
+    for (int i = 0; i < NMAGAZINES; i++) {
+        struct ZeroPool *pool = &zero_pools[i];
+        drained |= !!pool->zp_count;
+        while (pool->zp_count) page_release(pool->zp_pages[--pool->zp_count]);
+    }
+    return drained;
+}
+
+/* Put page the last reference to which is being dropped
+ * to the magazine of this CPU instead of freeing it */
+static bool
+magazine_put(struct Page *page) {
+    if (page->state != ALLOCATABLE_NODE || page->left || page->right ||
+        !list_empty((struct List *)page)) return 0;
+
+    int i = magazine_index(page->class);
+    if (i < 0) return 0;
+    struct PageMagazine *mag = &magazines[cpunum()][i];
+
+    if (mag->pm_count == magazine_sizes[i].capacity)
+        magazine_drain(mag, magazine_sizes[i].batch);
+    mag->pm_pages[mag->pm_count++] = page;
+
+#if SANITIZE_SHADOW_BASE
+    if (current_space) platform_asan_poison(KADDR(page2pa(page)), CLASS_SIZE(page->class));
+#endif
+    return 1;
+}
+
+/* Take the most recently freed page from the magazine
+ * of this CPU refilling it from the free lists if it is empty */
+static struct Page *
+magazine_get(int class, int flags) {
+    int i = magazine_index(class);
+    if (i < 0 || flags & (ALLOC_POOL | ALLOC_WEAK)) return NULL;
+    struct PageMagazine *mag = &magazines[cpunum()][i];
+
+    if (mag->pm_count) {
+        mag->pm_hits++;
+    } else {
+        mag->pm_misses++;
+        for (size_t n = 0; n < magazine_sizes[i].batch; n++) {
+            struct Page *page = buddy_alloc_page(class, flags);
+            if (!page) break;
+            page_ref(page);
+            mag->pm_pages[mag->pm_count++] = page;
+        }
+        if (!mag->pm_count) return NULL;
+        mag->pm_refills++;
+    }
+
+    struct Page *page = mag->pm_pages[mag->pm_count - 1];
+    if ((flags & ALLOC_BOOTMEM) && page2pa(page) + CLASS_SIZE(class) > BOOT_MEM_SIZE) return NULL;
+    mag->pm_count--;
+
+    assert(page->refc == 1 && !page->left && !page->right);
+    page->refc = 0;
+    return page;
+}
+
+/* Just allocate page, without mapping it */
+static struct Page *
+alloc_page(int class, int flags) {
+    if (flags & ALLOC_POOL) flags |= ALLOC_BOOTMEM;
+#ifndef SANITIZE_SHADOW_BASE
+    if (current_space) flags &= ~ALLOC_BOOTMEM;
+#endif
+
+    struct Page *page = magazine_get(class, flags);
+    if (!page) page = buddy_alloc_page(class, flags);
+    if (!page && magazine_drain_all()) page = buddy_alloc_page(class, flags);
+    return page;
+}
+
+/* Zero some more pages for the pools, called by CPUs
+ * that have nothing to run before they halt.
+ * Work is limited to one huge page worth of memory,
+ * since it is done with the kernel lock held */
+void
+zero_pool_fill(void) {
+    size_t budget = HUGE_PAGE_SIZE;
+
+    for (int i = NMAGAZINES - 1; i >= 0; i--) {
+        struct ZeroPool *pool = &zero_pools[i];
+        int class = magazine_sizes[i].class;
+
+        while (pool->zp_count < zero_pool_capacity[i] && budget >= CLASS_SIZE(class)) {
+            /* Not from magazines, their pages are better used hot */
+            struct Page *page = buddy_alloc_page(class, 0);
+            if (!page) return;
+            page_ref(page);
+            zero_page_phys(KADDR(page2pa(page)), CLASS_SIZE(class));
+            pool->zp_pages[pool->zp_count++] = page;
+            budget -= CLASS_SIZE(class);
+        }
+    }
+}
+
+/* Take pre-zeroed page of given class if there is one */
+static struct Page *
+zero_pool_get(int class) {
+    int i = magazine_index(class);
+    if (i < 0) return NULL;
+    struct ZeroPool *pool = &zero_pools[i];
+
+    if (!pool->zp_count) {
+        pool->zp_misses++;
+        return NULL;
+    }
+    pool->zp_hits++;
+
+    struct Page *page = pool->zp_pages[--pool->zp_count];
+    assert(page->refc == 1 && !page->left && !page->right);
+    page->refc = 0;
+    return page;
+}
+
 int
 region_maxref(struct AddressSpace *spc, uintptr_t addr, size_t size) {
     uintptr_t start = ROUNDDOWN(addr, PAGE_SIZE);
@@ -1164,6 +1476,35 @@ region_maxref(struct AddressSpace *spc, uintptr_t addr, size_t size) {
     return res;
 }
 
+/* Translate address va mapped with permissions perm
+ * in address space spc to physical one.
+ * Returns -E_FAULT if there is no such mapping */
+int
+region_phys(struct AddressSpace *spc, uintptr_t va, int perm, physaddr_t *pa) {
+    struct Page *page = page_lookup_virtual(spc->root, va, 0, LOOKUP_PRESERVE);
+    if (!page || !page->phy || (page->state & perm) != perm) return -E_FAULT;
+
+    *pa = page2pa(page->phy) + (va & CLASS_MASK(page->phy->class));
+    return 0;
+}
+
+static void
+shared_walk(struct Page *node, void (*fn)(physaddr_t start, size_t size)) {
+    if (!node) return;
+    if (node->phy) {
+        if (node->state & PROT_SHARE) fn(page2pa(node->phy), CLASS_SIZE(node->phy->class));
+        return;
+    }
+    shared_walk(node->left, fn);
+    shared_walk(node->right, fn);
+}
+
+/* Call fn for physical pages mapped with PROT_SHARE in spc */
+void
+shared_regions(struct AddressSpace *spc, void (*fn)(physaddr_t start, size_t size)) {
+    shared_walk(spc->root, fn);
+}
+
 inline static int
 addr_common_class(uintptr_t addr1, uintptr_t addr2) {
     assert(!((addr1 | addr2) & CLASS_MASK(0)));
@@ -1245,6 +1586,134 @@ alloc_composite_page(struct AddressSpace *spc, uintptr_t addr, int class, int fl
     return res;
 }
 
+/* Lazy mapping of physical page phy is zero-filled memory */
+static bool
+is_zero_fill(struct Page *phy) {
+    return page2pa(phy) - PADDR(zero_page_raw) < HUGE_PAGE_SIZE;
+}
+
+/* Replace lazy mapping page at va (aligned to its class)
+ * with a private copy of the memory or just make it
+ * writable if it is the only reference to it */
+static int
+resolve_lazy_page(struct AddressSpace *spc, uintptr_t va, struct Page *page) {
+    int res;
+    if (PAGE_IS_UNIQ(page->phy)) {
+        /* If we have the only reference to the page and
+         * and its mapping to itself we can actually just
+         * disable lazy flag and not bother copying */
+        res = map_page(spc, va, page->phy, page->state & ~PROT_LAZY);
+    } else {
+        if (trace_memory) {
+            cprintf("<%p> Allocating new page [%08lX, %08lX] flags=%x\n", spc,
+                    va, va + (long)CLASS_MASK(page->phy->class), page->state & PROT_ALL & ~PROT_LAZY);
+        }
+
+        struct Page *phy = page->phy;
+        int flags = page->state & PROT_ALL & ~PROT_LAZY;
+
+        /* Lazily zeroed memory refers to zero_page_raw,
+         * copying it can be avoided with a pre-zeroed page */
+        struct Page *zeroed = NULL;
+        if (is_zero_fill(phy))
+            zeroed = zero_pool_get(phy->class);
+
+        if (zeroed) {
+            res = map_page(spc, va, zeroed, flags);
+        } else {
+            page_ref(phy);
+            res = alloc_composite_page(spc, va, phy->class, flags);
+            if (!res) memcpy_page(spc, va, phy);
+            if (!res && !is_zero_fill(phy)) spc->cow_copied += CLASS_SIZE(phy->class);
+            page_unref(phy);
+        }
+    }
+    return res;
+}
+
+/* Resolve lazy mappings following the one at va that faulted, when
+ * the previous fault was right before it (memory is touched sequentially).
+ * Only zero-filled and uniquely owned memory is resolved,
+ * copying shared pages ahead of time is a waste if they are not written.
+ * Returns the end of resolved memory */
+static uintptr_t
+fault_around(struct AddressSpace *spc, uintptr_t va, uintptr_t end) {
+    if (spc->fault_next != va || !spc->fault_around) return end;
+
+    /* Stay within the page table page */
+    uintptr_t limit = MIN(end + spc->fault_around, ROUNDDOWN(va, HUGE_PAGE_SIZE) + HUGE_PAGE_SIZE);
+    while (end < limit) {
+        struct Page *page = page_lookup_virtual(spc->root, end, 0, LOOKUP_PRESERVE);
+        if (!page || !page->phy || !(page->state & PROT_LAZY)) break;
+
+        struct Page *phy = page->phy;
+        if (!PAGE_IS_UNIQ(phy) && !is_zero_fill(phy)) break;
+
+        size_t size = CLASS_SIZE(phy->class);
+        if (end & (size - 1) || end + size > limit) break;
+        if (resolve_lazy_page(spc, end, page) < 0) break;
+        end += size;
+    }
+    return end;
+}
+
+/* Count bytes of lazy and resolved mappings in the subtree of node */
+static void
+count_mapped(struct Page *node, size_t *lazy, size_t *resolved) {
+    if (!node) return;
+    if (node->phy) {
+        *(node->state & PROT_LAZY ? lazy : resolved) += CLASS_SIZE(node->phy->class);
+        return;
+    }
+    count_mapped(node->left, lazy, resolved);
+    count_mapped(node->right, lazy, resolved);
+}
+
+/* Choose class of memory to copy on write to shared large page at va.
+ *
+ * Only the written 4K page is copied until most of the memory
+ * around it (within the huge page) is resolved, then the memory
+ * is assumed to be written densely, the whole faulting mapping
+ * is copied and *promote is set to copy the rest of the huge page */
+static int
+cow_copy_class(struct AddressSpace *spc, uintptr_t va, int maxclass, bool *promote) {
+    struct Page *page = page_lookup_virtual(spc->root, va, 0, LOOKUP_PRESERVE);
+    if (!page || !page->phy || !(page->state & PROT_LAZY) || !page->phy->class ||
+        PAGE_IS_UNIQ(page->phy) || is_zero_fill(page->phy)) return maxclass;
+
+    /* Find the subtree of the huge page */
+    struct Page *node = spc->root;
+    for (int class = MAX_CLASS; node && !node->phy && class > MAX_ALLOCATION_CLASS; class--)
+        node = va & CLASS_SIZE(class - 1) ? node->right : node->left;
+
+    size_t lazy = 0, resolved = 0;
+    count_mapped(node, &lazy, &resolved);
+    if (!resolved || resolved < lazy) return 0;
+
+    *promote = 1;
+    return maxclass;
+}
+
+/* Copy the rest of writable copy-on-write memory
+ * within the huge page at va (see cow_copy_class()) */
+static void
+cow_promote(struct AddressSpace *spc, uintptr_t va) {
+    uintptr_t end = ROUNDDOWN(va, HUGE_PAGE_SIZE) + HUGE_PAGE_SIZE;
+    for (uintptr_t cur = end - HUGE_PAGE_SIZE; cur < end;) {
+        struct Page *page = page_lookup_virtual(spc->root, cur, 0, LOOKUP_PRESERVE);
+        if (!page || !page->phy) {
+            cur += PAGE_SIZE;
+            continue;
+        }
+
+        size_t size = CLASS_SIZE(page->phy->class);
+        cur = ROUNDDOWN(cur, size);
+        if ((page->state & (PROT_LAZY | PROT_W)) == (PROT_LAZY | PROT_W) &&
+            !is_zero_fill(page->phy) && resolve_lazy_page(spc, cur, page) < 0) return;
+        cur += size;
+    }
+}
+
 int
 force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass) {
     int res = -E_FAULT;
@@ -1262,30 +1731,28 @@ force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass) {
     old = switch_address_space(spc = (va > MAX_USER_ADDRESS ? &kspace : spc));
 
 
+    /* Shared large pages are copied in small pieces when sparsely written */
+    bool promote = 0;
+    if (spc != &kspace) maxclass = cow_copy_class(spc, va, maxclass, &promote);
+
     /* Lookup page mapping such that it's class it not larger than MAX_ALLOCATION_CLASS */
     struct Page *page;
     if (!(page = page_lookup_virtual(spc->root, va, maxclass, LOOKUP_SPLIT))) goto fault;
     if (!(page = page_lookup_virtual(spc->root, va, 0, LOOKUP_PRESERVE))) goto fault;
     if (!(page->state & PROT_LAZY)) goto fault;
 
+    uintptr_t fault_va = va;
     va &= ~CLASS_MASK(page->phy->class);
-
-    if (PAGE_IS_UNIQ(page->phy)) {
-        /* If we have the only reference to the page and
-         * and its mapping to itself we can actually just
-         * disable lazy flag and not bother copying */
-        res = map_page(spc, va, page->phy, page->state & ~PROT_LAZY);
-    } else {
-        if (trace_memory) {
-            cprintf("<%p> Allocating new page [%08lX, %08lX] flags=%x\n", spc,
-                    va, va + (long)CLASS_MASK(page->phy->class), page->state & PROT_ALL & ~PROT_LAZY);
-        }
-
-        struct Page *phy = page->phy;
-        page_ref(phy);
-        res = alloc_composite_page(spc, va, phy->class, page->state & PROT_ALL & ~PROT_LAZY);
-        if (!res) memcpy_page(spc, va, phy);
-        page_unref(phy);
+    uintptr_t end = va + CLASS_SIZE(page->phy->class);
+    bool cow = !PAGE_IS_UNIQ(page->phy) && !is_zero_fill(page->phy);
+
+    res = resolve_lazy_page(spc, va, page);
+    if (!res && spc != &kspace) {
+        if (cow) spc->cow_dirtied += PAGE_SIZE;
+        if (promote)
+            cow_promote(spc, fault_va);
+        else
+            spc->fault_next = fault_around(spc, va, end);
     }
 
 fault:
@@ -1303,6 +1770,116 @@ fault:
     return res;
 }
 
+/* Number of huge pages assembled by huge_collapse_scan() */
+uint64_t huge_collapsed;
+
+/* Find the first huge page sized range at or above *cursor
+ * that is mapped with smaller pages (subtree of node of given class at addr) */
+static struct Page *
+collapse_find(struct Page *node, int class, uintptr_t addr, uintptr_t *cursor) {
+    if (!node || node->phy || addr + CLASS_SIZE(class) <= *cursor) return NULL;
+    if (class == MAX_ALLOCATION_CLASS) {
+        *cursor = addr;
+        return node;
+    }
+
+    struct Page *res = collapse_find(node->left, class - 1, addr, cursor);
+    if (!res) res = collapse_find(node->right, class - 1, addr + CLASS_SIZE(class - 1), cursor);
+    return res;
+}
+
+/* Range is fully mapped by private resolved memory
+ * with the same protection (*state, -1 if not known yet) */
+static bool
+collapse_check(struct Page *node, int *state) {
+    if (!node) return 0;
+    if (!node->phy)
+        return collapse_check(node->left, state) && collapse_check(node->right, state);
+
+    if (node->state & PROT_LAZY || !PAGE_IS_UNIQ(node->phy) ||
+        node->phy->state != ALLOCATABLE_NODE) return 0;
+    if (*state < 0) *state = node->state;
+    return node->state == *state;
+}
+
+/* Copy memory mapped by subtree of node of given class at addr
+ * to dst, which is the linear mapping of the huge page at base */
+static void
+collapse_copy(struct Page *node, int class, uintptr_t addr, uintptr_t base, uint8_t *dst) {
+    if (node->phy) {
+        copy_page_phys(dst + (addr - base), KADDR(page2pa(node->phy)), CLASS_SIZE(class));
+        return;
+    }
+    collapse_copy(node->left, class - 1, addr, base, dst);
+    collapse_copy(node->right, class - 1, addr + CLASS_SIZE(class - 1), base, dst);
+}
+
+/* Replace mappings of range at va in subtree node with a huge page */
+static bool
+collapse_huge_page(struct AddressSpace *spc, uintptr_t va, struct Page *node, int state) {
+    struct Page *page = alloc_page(MAX_ALLOCATION_CLASS, 0);
+    if (!page) return 0;
+
+    collapse_copy(node, MAX_ALLOCATION_CLASS, va, va, KADDR(page2pa(page)));
+
+    /* Old pages and their page table are freed by map_page() */
+    int res = map_page(spc, va, page, PAGE_PROT(state));
+    if (res < 0) {
+        env_destroy((void *)((uint8_t *)spc - offsetof(struct Env, address_space)));
+        return 0;
+    }
+
+    if (trace_memory) cprintf("<%p> Collapsed [%08lX, %08lX] into a huge page\n",
+                              spc, va, va + (long)CLASS_MASK(MAX_ALLOCATION_CLASS));
+    huge_collapsed++;
+    return 1;
+}
+
+/* Environment memory can be moved to other physical pages */
+static bool
+collapse_allowed(struct Env *env) {
+    /* Not running on other CPUs */
+    if (env->env_status != ENV_RUNNABLE && env->env_status != ENV_NOT_RUNNABLE) return 0;
+    /* Futexes are keyed by physical address */
+    if (!list_empty(&env->env_futex)) return 0;
+    /* Drivers give physical addresses of their memory to devices */
+    return env->env_type != ENV_TYPE_FS;
+}
+
+/* Find ranges of user memory mapped with small pages that could be
+ * mapped with a single huge page and collapse them, to save TLB entries.
+ * Called by CPUs that have nothing to run before they halt,
+ * examines a few ranges and collapses at most one at a time.
+ * Kernel memory is not collapsed, it is also accessed
+ * through the linear physical memory mapping (KADDR) */
+void
+huge_collapse_scan(void) {
+    static int scan_env;
+    static uintptr_t scan_cursor;
+    int budget = 16;
+
+    for (int nenvs = 0; budget && nenvs < NENV;) {
+        struct Env *env = &envs[scan_env];
+        struct Page *node = NULL;
+        if (collapse_allowed(env))
+            node = collapse_find(env->address_space.root, MAX_CLASS, 0, &scan_cursor);
+        if (!node || scan_cursor >= MAX_USER_ADDRESS) {
+            scan_env = (scan_env + 1) % NENV;
+            scan_cursor = 0;
+            nenvs++;
+            continue;
+        }
+        struct AddressSpace *spc = &env->address_space;
+
+        uintptr_t va = scan_cursor;
+        scan_cursor += HUGE_PAGE_SIZE;
+        budget--;
+
+        int state = -1;
+        if (collapse_check(node, &state) && collapse_huge_page(spc, va, node, state)) return;
+    }
+}
+
 static int
 do_map_page(struct AddressSpace *dspace, uintptr_t dst, struct AddressSpace *sspace, uintptr_t src, struct Page *phy, int oldflags, int flags) {
     int res;
@@ -1509,6 +2086,23 @@ release_address_space(struct AddressSpace *space) {
 }
 
 
+/* Give space a PCID of the current generation */
+static void
+pcid_assign(struct AddressSpace *space) {
+    if (pcid_next == NPCID) {
+        /* PCIDs are going to be reused, every CPU
+         * can have TLB entries tagged with them */
+        pcid_generation++;
+        pcid_next = 1;
+        for (struct CpuInfo *cpu = cpus; cpu < cpus + ncpu; cpu++)
+            cpu->cpu_tlb_stale = 1;
+    }
+
+    space->pcid = pcid_next++;
+    space->pcid_gen = pcid_generation;
+    space->tlb_stale = 0;
+}
+
 /*
  * This function is used for switch address spaces
  *
@@ -1519,18 +2113,44 @@ release_address_space(struct AddressSpace *space) {
  * if space == current_space for performance reasons
  * (Why it might me impactful?)
  *
+ * With PCIDs TLB entries of the space are kept
+ * unless they have been invalidated while it was
+ * not loaded on this CPU (see tlb_invalidate_range())
+ *
  * Returns old address space
  */
 struct AddressSpace *
 switch_address_space(struct AddressSpace *space) {
     assert(space);
     // LAB 7: Your code here
-    if (space == current_space) return current_space;
+    struct CpuInfo *cpu = thiscpu;
+    uint32_t cpumask = 1U << cpunum();
+    if (space == current_space && !(space->tlb_stale & cpumask)) return current_space;
 
     struct AddressSpace *old_space = current_space;
-
     current_space = space;
-    lcr3(current_space->cr3);
+
+    if (!pcid_enabled) {
+        space->tlb_stale &= ~cpumask;
+        lcr3(space->cr3);
+        return old_space;
+    }
+
+    if (space->pcid_gen != pcid_generation) pcid_assign(space);
+
+    uint64_t noflush = CR3_NOFLUSH;
+    if (cpu->cpu_tlb_stale) {
+        /* Toggling CR4_PGE flushes entries of all PCIDs */
+        uint64_t cr4 = rcr4();
+        lcr4(cr4 ^ CR4_PGE);
+        lcr4(cr4);
+        cpu->cpu_tlb_stale = 0;
+    } else if (space->tlb_stale & cpumask) {
+        noflush = 0;
+    }
+    space->tlb_stale &= ~cpumask;
+
+    lcr3(space->cr3 | space->pcid | noflush);
 
     return old_space;
 }
@@ -1555,6 +2175,11 @@ init_address_space(struct AddressSpace *space) {
     /* Initialize UVPT */
     // LAB 8: Your code here
     space->pml4[PML4_INDEX(UVPT)] = space->cr3 | PTE_P | PTE_U;
+    /* Structure can be reused, previous PCID has stale entries */
+    space->pcid_gen = 0;
+    space->fault_around = FAULT_AROUND_DEFAULT * PAGE_SIZE;
+    space->fault_next = 0;
+    space->cow_copied = space->cow_dirtied = 0;
     /* Why this call is required here and what does it do? */
     propagate_one_pml4(space, &kspace);
     return 0;
@@ -1640,6 +2265,9 @@ detect_memory(void) {
         attach_region(0, max_memory_map_addr, ALLOCATABLE_NODE);
     }
 
+    /* Reserve the page AP bootstrap code is copied to */
+    attach_region(MPENTRY_PADDR, MPENTRY_PADDR + PAGE_SIZE, RESERVED_NODE);
+
     if (trace_init) {
         cprintf("Physical memory: %zuM available, base = %zuK, extended = %zuK\n",
                 (size_t)((basemem + extmem) / MB), (size_t)(basemem / KB), (size_t)(extmem / KB));
@@ -1666,8 +2294,9 @@ init_allocator(void) {
     metaheaptop = KERN_HEAP_START + ROUNDUP(uefi_lp->FrameBufferSize, PAGE_SIZE);
 
     /* Initialize lists */
-    for (size_t i = 0; i < MAX_CLASS; i++)
-        list_init(&free_classes[i]);
+    for (size_t zone = 0; zone < FREE_NZONES; zone++)
+        for (size_t i = 0; i < MAX_CLASS; i++)
+            list_init(&free_classes[zone][i]);
 
     /* Initialize first pool */
 
@@ -1690,8 +2319,11 @@ init_allocator(void) {
     cpuid(0x80000001, NULL, NULL, NULL, &edx);
     has_1gb_pages = edx & (1 << 26);
     nx_supported = edx & (1 << 20);
+    uint32_t ecx;
+    cpuid(1, NULL, NULL, &ecx, NULL);
+    pcid_supported = ecx & (1 << 17);
     if (trace_init)
-        cprintf("CPUID: 1GB pages: %d, NX: %d\n", has_1gb_pages, nx_supported);
+        cprintf("CPUID: 1GB pages: %d, NX: %d, PCID: %d\n", has_1gb_pages, nx_supported, pcid_supported);
 }
 
 void *
@@ -1860,6 +2492,23 @@ init_memory(void) {
     res = map_physical_region(&kspace, KERN_PF_STACK_TOP - KERN_PF_STACK_SIZE, PADDR(pfstack), KERN_PF_STACK_SIZE, PROT_R | PROT_W);
     if (res < 0) panic("Failed to map page fault stack: %d\n", res);
 
+    /* Stacks of other CPUs are located below with KERN_STACK_STRIDE step
+     * (BSP keeps using bootstack) */
+    for (int i = 1; i < NCPU; i++) {
+        res = map_physical_region(&kspace, KERN_STACK_TOP - i * KERN_STACK_STRIDE - KERN_STACK_SIZE,
+                                  PADDR(percpu_kstacks[i]), KERN_STACK_SIZE, PROT_R | PROT_W);
+        if (res < 0) panic("Failed to map kernel stack of CPU %d: %d\n", i, res);
+
+        res = map_physical_region(&kspace, KERN_PF_STACK_TOP - i * KERN_STACK_STRIDE - KERN_PF_STACK_SIZE,
+                                  PADDR(percpu_pfstacks[i]), KERN_PF_STACK_SIZE, PROT_R | PROT_W);
+        if (res < 0) panic("Failed to map page fault stack of CPU %d: %d\n", i, res);
+    }
+
+    /* APs start in real mode and enable paging while running
+     * the bootstrap code so it should be identity mapped */
+    res = map_physical_region(&kspace, MPENTRY_PADDR, MPENTRY_PADDR, PAGE_SIZE, PROT_R | PROT_X);
+    if (res < 0) panic("Failed to map AP bootstrap code: %d\n", res);
+
 #ifdef SANITIZE_SHADOW_BASE
     init_shadow_pre();
 #endif
@@ -1885,7 +2534,8 @@ init_memory(void) {
     /* Set appropriate cr0 and cr4 bits
      * (In assembly code only minimal set of modes was set)*/
     lcr0(CR0_PE | CR0_PG | CR0_AM | CR0_WP | CR0_NE | CR0_MP);
-    lcr4(CR4_PSE | CR4_PAE | CR4_PCE);
+    lcr4(CR4_PSE | CR4_PAE | CR4_PCE | (pcid_supported ? CR4_PCIDE : 0));
+    pcid_enabled = pcid_supported;
 
     /* Enable NX bit (execution protection) */
     uint64_t efer = rdmsr(EFER_MSR);
@@ -1991,7 +2641,8 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm) {
             user_mem_check_addr = (uintptr_t)(MAX(va, current));
             return -E_FAULT;
         }
-        current += PAGE_SIZE;
+        /* Whole mapping has the same permissions */
+        current = (void *)ROUNDDOWN(current, CLASS_SIZE(page->phy->class)) + CLASS_SIZE(page->phy->class);
     }
     if ((uintptr_t)end > MAX_USER_READABLE) {
         user_mem_check_addr = MAX(MAX_USER_READABLE, (uintptr_t)current);
@@ -2000,12 +2651,145 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm) {
     return 0;
 }
 
+/* Exception table entry: page fault at fault_rip that cannot be
+ * resolved continues at fixup_rip (see user_fault_fixup()).
+ * Entries are collected into __ex_table by the linker script */
+struct ExTable {
+    uintptr_t fault_rip;
+    uintptr_t fixup_rip;
+};
+
+extern const struct ExTable __ex_table_start[], __ex_table_end[];
+
+/* Makes instruction at label 1 continue at label 3
+ * with error code efault in res if it faults */
+#define USER_ACCESS_FIXUP                      \
+    "2:\n"                                     \
+    ".pushsection .text.fixup, \"ax\"\n"       \
+    "3: movl %[efault], %[res]\n"              \
+    "   jmp 2b\n"                              \
+    ".popsection\n"                            \
+    ".pushsection __ex_table, \"a\"\n"         \
+    ".balign 8\n"                              \
+    ".quad 1b, 3b\n"                           \
+    ".popsection\n"
+
+/* Kernel page fault handler (trap()) calls this for faults
+ * it has not resolved. Fault on user memory accessed by copyin(),
+ * copyout() or user_mem_assert() makes them return -E_FAULT */
+bool
+user_fault_fixup(struct Trapframe *tf, uintptr_t va) {
+    for (const struct ExTable *entry = __ex_table_start; entry < __ex_table_end; entry++) {
+        if (entry->fault_rip == tf->tf_rip) {
+            user_mem_check_addr = va;
+            tf->tf_rip = entry->fixup_rip;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Copy len bytes, faults on user memory are
+ * resolved by trap() as if user accessed it */
+static int
+user_copy(void *dst, const void *src, size_t len) {
+    int res = 0;
+    asm volatile("1: rep movsb\n" USER_ACCESS_FIXUP
+                 : [res] "+r"(res), "+D"(dst), "+S"(src), "+c"(len)
+                 : [efault] "i"(-E_FAULT)
+                 : "memory");
+    return res;
+}
+
+/* Touch byte at va for reading or writing,
+ * writing it does not change memory contents */
+static int
+user_touch(uintptr_t va, bool write) {
+    int res = 0;
+    if (write) {
+        asm volatile("1: lock orb $0, (%[va])\n" USER_ACCESS_FIXUP
+                     : [res] "+r"(res)
+                     : [va] "r"(va), [efault] "i"(-E_FAULT)
+                     : "memory");
+    } else {
+        asm volatile("1: movb (%[va]), %%al\n" USER_ACCESS_FIXUP
+                     : [res] "+r"(res)
+                     : [va] "r"(va), [efault] "i"(-E_FAULT)
+                     : "rax", "memory");
+    }
+    return res;
+}
+
+/* #PF handler runs on the dedicated stack which is
+ * not switched for nested faults, so it cannot fault */
+static bool
+on_pf_stack(void) {
+    uintptr_t top = KERN_PF_STACK_TOP - cpunum() * KERN_STACK_STRIDE;
+    uintptr_t rsp = read_rsp();
+    return rsp <= top && rsp > top - KERN_PF_STACK_SIZE;
+}
+
+/* Range lies below MAX_USER_ADDRESS where everything
+ * mapped is user memory, so it can be simply accessed */
+static bool
+user_range_direct(const void *va, size_t len) {
+    return len <= MAX_USER_ADDRESS && (uintptr_t)va <= MAX_USER_ADDRESS - len;
+}
+
+/* Copy len bytes from user address usrc of the current environment.
+ * Returns 0 or -E_FAULT if memory is not readable by user */
+int
+copyin(void *dst, const void *usrc, size_t len) {
+    assert(curenv && current_space == &curenv->address_space && !on_pf_stack());
+
+    if (user_range_direct(usrc, len)) return user_copy(dst, usrc, len);
+
+    /* Read-only pages above MAX_USER_ADDRESS are mixed with kernel ones */
+    int res = user_mem_check(curenv, usrc, len, PROT_R | PROT_USER_);
+    if (!res) nosan_memcpy(dst, (void *)usrc, len);
+    return res;
+}
+
+/* Copy len bytes to user address udst of the current environment.
+ * Returns 0 or -E_FAULT if memory is not writable by user */
+int
+copyout(void *udst, const void *src, size_t len) {
+    assert(curenv && current_space == &curenv->address_space && !on_pf_stack());
+
+    if (!user_range_direct(udst, len)) {
+        user_mem_check_addr = MAX((uintptr_t)udst, MAX_USER_ADDRESS);
+        return -E_FAULT;
+    }
+    return user_copy(udst, src, len);
+}
+
+/* Report access to user memory that failed like
+ * user_mem_assert() does and destroy env */
+void
+user_mem_fault(struct Env *env) {
+    cprintf("[%08x] user_mem_check assertion failure for "
+            "va=%016zx ip=%016zx\n",
+            env->env_id, user_mem_check_addr, env->env_tf.tf_rip);
+    env_destroy(env); /* may not return */
+}
+
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm) {
-    if (user_mem_check(env, va, len, perm | PROT_USER_) < 0) {
-        cprintf("[%08x] user_mem_check assertion failure for "
-                "va=%016zx ip=%016zx\n",
-                env->env_id, user_mem_check_addr, env->env_tf.tf_rip);
-        env_destroy(env); /* may not return */
+    /* Memory of the current environment is validated by touching
+     * every page of it unless the fault would be a recursive one.
+     * The first page is touched at va, so that its address is reported */
+    if (current_space == &env->address_space && !on_pf_stack() &&
+        user_range_direct(va, len) && !(perm & ~(PROT_R | PROT_W | PROT_USER_))) {
+        for (uintptr_t cur = (uintptr_t)va; cur < (uintptr_t)va + len;
+             cur = ROUNDDOWN(cur, PAGE_SIZE) + PAGE_SIZE) {
+            if (user_touch(cur, perm & PROT_W) < 0) {
+                user_mem_fault(env);
+                return;
+            }
+        }
+        return;
     }
+
+    if (user_mem_check(env, va, len, perm | PROT_USER_) < 0)
+        user_mem_fault(env);
 }
@@ -10,6 +10,7 @@
 #include <inc/assert.h>
 #include <inc/env.h>
 #include <inc/x86.h>
+#include <kern/cpu.h>
 
 #define CLASS_BASE    12
 #define CLASS_SIZE(c) (1ULL << ((c) + CLASS_BASE))
@@ -111,9 +112,16 @@ void unmap_region(struct AddressSpace *dspace, uintptr_t dst, uintptr_t size);
 void init_memory(void);
 void release_address_space(struct AddressSpace *space);
 struct AddressSpace *switch_address_space(struct AddressSpace *space);
+void tlb_shootdown_serve(void);
 int init_address_space(struct AddressSpace *space);
 void user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+void user_mem_fault(struct Env *env);
+bool user_fault_fixup(struct Trapframe *tf, uintptr_t va);
+int copyin(void *dst, const void *usrc, size_t len);
+int copyout(void *udst, const void *src, size_t len);
 int region_maxref(struct AddressSpace *spc, uintptr_t addr, size_t size);
+int region_phys(struct AddressSpace *spc, uintptr_t va, int perm, physaddr_t *pa);
+void shared_regions(struct AddressSpace *spc, void (*fn)(physaddr_t start, size_t size));
 int force_alloc_page(struct AddressSpace *spc, uintptr_t va, int maxclass);
 void dump_page_table(pte_t *pml4);
 void dump_memory_lists(void);
@@ -125,7 +133,46 @@ void *mmio_map_region(physaddr_t addr, size_t size);
 void *mmio_remap_last_region(physaddr_t addr, void *oldva, size_t oldsz, size_t size);
 
 extern struct AddressSpace kspace;
-extern struct AddressSpace *current_space;
+#define current_space (thiscpu->cpu_space)
+extern bool pcid_enabled;
+
+/* TLB invalidation statistics */
+struct TlbStat {
+    uint64_t ts_page;   /* Ranges invalidated with invlpg per 4KB page */
+    uint64_t ts_large;  /* Ranges invalidated with invlpg per large page */
+    uint64_t ts_full;   /* Full TLB flushes */
+    uint64_t ts_invlpg; /* Number of invlpg executed */
+    uint64_t ts_shootdown; /* Shootdown IPIs sent to other CPUs */
+};
+extern struct TlbStat tlbstat;
+extern size_t tlb_flush_ceiling;
+
+/* Per-CPU caches of freed pages (see kern/pmap.c) */
+#define NMAGAZINES    2
+#define MAGAZINE_SIZE 64
+struct PageMagazine {
+    size_t pm_count;                     /* Number of cached pages */
+    struct Page *pm_pages[MAGAZINE_SIZE]; /* Cached pages, most recently freed last */
+    uint64_t pm_hits;                    /* Allocations served from the magazine */
+    uint64_t pm_misses;                  /* Allocations that found it empty */
+    uint64_t pm_refills;                 /* Batches taken from the free lists */
+    uint64_t pm_drains;                  /* Batches returned to the free lists */
+};
+extern struct PageMagazine magazines[NCPU][NMAGAZINES];
+
+/* Pools of pre-zeroed pages of the same sizes */
+#define ZERO_POOL_SIZE 128
+struct ZeroPool {
+    size_t zp_count;                      /* Number of zeroed pages */
+    struct Page *zp_pages[ZERO_POOL_SIZE]; /* Zeroed pages */
+    uint64_t zp_hits;                     /* Faults served from the pool */
+    uint64_t zp_misses;                   /* Faults that found it empty */
+};
+extern struct ZeroPool zero_pools[NMAGAZINES];
+void zero_pool_fill(void);
+
+extern uint64_t huge_collapsed;
+void huge_collapse_scan(void);
 extern struct Page root;
 extern char bootstacktop[], bootstack[];
 extern size_t max_memory_map_addr;
@@ -1,47 +1,378 @@
 #include <inc/assert.h>
 #include <inc/x86.h>
 #include <kern/env.h>
+#include <kern/list.h>
 #include <kern/monitor.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/timer.h>
+#include <kern/tsc.h>
 
-
-struct Taskstate cpu_ts;
 _Noreturn void sched_halt(void);
 
+/* Quantum of priority level in scheduler timer ticks */
+#define SCHED_QUANTUM(prio) (1U << (prio))
+/* Every SCHED_BOOST_TICKS tick periods all environments are moved
+ * back to the highest priority so that CPU-bound ones can't starve */
+#define SCHED_BOOST_TICKS 16
+
+/* Multi-level feedback queue.
+ *
+ * Every CPU has its own set of run queues (CpuInfo->cpu_runq)
+ * containing runnable environments of each priority level in FIFO order
+ * (linked by Env->env_runq). Environment is queued to the CPU
+ * it has been running on (Env->env_cpunum), CPU without
+ * runnable environments steals them from the busiest one. */
+
+/* Timer interrupts are only generated when they are needed:
+ * CPU is ticking while environments are waiting in its run queues,
+ * and the timer is stopped when it is idle or runs the only
+ * runnable environment (see sched_timer_update()) */
+
+/* Blocked environments waiting with timeout
+ * linked by Env->env_timed (see sched_set_timeout()) */
+static struct List sched_timed;
+
+/* TSC value of the last priority boost */
+static uint64_t sched_boost_tsc;
+/* Incremented on every priority boost */
+static uint32_t sched_epoch;
+
+
+void
+sched_init(void) {
+    for (int c = 0; c < NCPU; c++)
+        for (int i = 0; i < NPRIO; i++)
+            list_init(&cpus[c].cpu_runq[i]);
+    list_init(&sched_timed);
+}
+
+/* Apply priority boost that happened while env was not runnable */
+static void
+sched_apply_boost(struct Env *env) {
+    if (env->env_boost_epoch == sched_epoch) return;
+
+    env->env_boost_epoch = sched_epoch;
+    if (!env->env_prio_pinned) {
+        env->env_prio = ENV_PRIO_HIGH;
+        env->env_slice = SCHED_QUANTUM(ENV_PRIO_HIGH);
+    }
+}
+
+/* Whether timer of cpu is going to interrupt it within a tick */
+static bool
+sched_cpu_ticking(struct CpuInfo *cpu) {
+    if (!cpu->cpu_timer || !cpu->cpu_timer->set_oneshot) return 1;
+
+    return cpu->cpu_timer_deadline &&
+           cpu->cpu_timer_deadline <= read_tsc() + ns2tsc(SCHED_TICK_NS);
+}
+
+/* Make sure env queued to another CPU is noticed by it,
+ * it has to be woken up if it is halted or runs without ticks.
+ * Env queued to this CPU behind the running environment
+ * is better to be stolen by some halted CPU */
+static void
+sched_kick(struct Env *env) {
+    struct CpuInfo *home = &cpus[env->env_cpunum];
+    if (home != thiscpu) {
+        if (home->cpu_status == CPU_HALTED || !sched_cpu_ticking(home))
+            lapic_ipi(home, IRQ_OFFSET + IRQ_RESCHED);
+        return;
+    }
+
+    if (!curenv || curenv == env || curenv->env_status != ENV_RUNNING) return;
+
+    for (struct CpuInfo *cpu = cpus; cpu < cpus + ncpu; cpu++) {
+        if (cpu != thiscpu && cpu->cpu_status == CPU_HALTED) {
+            lapic_ipi(cpu, IRQ_OFFSET + IRQ_RESCHED);
+            return;
+        }
+    }
+}
+
+static void
+sched_queue(struct Env *env) {
+    assert(list_empty(&env->env_runq));
+
+    sched_apply_boost(env);
+    if (!env->env_slice) env->env_slice = SCHED_QUANTUM(env->env_prio);
+
+    struct CpuInfo *cpu = &cpus[env->env_cpunum];
+    list_append(cpu->cpu_runq[env->env_prio].prev, &env->env_runq);
+    cpu->cpu_runq_mask |= 1U << env->env_prio;
+    cpu->cpu_nrunnable++;
+}
+
+/* Appends env to the tail of the run queue of its priority */
+void
+sched_enqueue(struct Env *env) {
+    sched_queue(env);
+    sched_kick(env);
+}
+
+/* Removes env from the run queue */
+void
+sched_dequeue(struct Env *env) {
+    struct CpuInfo *cpu = &cpus[env->env_cpunum];
+    list_del(&env->env_runq);
+    if (list_empty(&cpu->cpu_runq[env->env_prio]))
+        cpu->cpu_runq_mask &= ~(1U << env->env_prio);
+    cpu->cpu_nrunnable--;
+}
+
+/* Take the most recently queued environment of
+ * the highest priority from the busiest CPU */
+static struct Env *
+sched_steal(void) {
+    struct CpuInfo *victim = NULL;
+    for (struct CpuInfo *cpu = cpus; cpu < cpus + ncpu; cpu++) {
+        if (cpu->cpu_nrunnable && (!victim || cpu->cpu_nrunnable > victim->cpu_nrunnable))
+            victim = cpu;
+    }
+    if (!victim) return NULL;
+
+    struct List *queue = &victim->cpu_runq[__builtin_ctz(victim->cpu_runq_mask)];
+    return LIST_ENTRY(queue->prev, struct Env, env_runq);
+}
+
+/* Move all runnable environments to the highest priority.
+ * Blocked ones are boosted lazily when they are enqueued */
+static void
+sched_boost(void) {
+    struct List boosted;
+    list_init(&boosted);
+
+    sched_epoch++;
+    for (struct CpuInfo *cpu = cpus; cpu < cpus + ncpu; cpu++) {
+        for (int i = ENV_PRIO_HIGH + 1; i < NPRIO; i++) {
+            while (!list_empty(&cpu->cpu_runq[i])) {
+                struct Env *env = LIST_ENTRY(cpu->cpu_runq[i].next, struct Env, env_runq);
+                sched_dequeue(env);
+                list_append(boosted.prev, &env->env_runq);
+            }
+        }
+    }
+
+    while (!list_empty(&boosted)) {
+        struct Env *env = LIST_ENTRY(boosted.next, struct Env, env_runq);
+        list_del(&env->env_runq);
+        sched_enqueue(env);
+    }
+}
+
+/* Environment that gives up the CPU to wait for IPC
+ * is I/O-bound, raise its priority by one level */
+void
+sched_promote(struct Env *env) {
+    assert(list_empty(&env->env_runq));
+
+    if (!env->env_prio_pinned && env->env_prio > ENV_PRIO_HIGH) {
+        env->env_prio--;
+        env->env_slice = SCHED_QUANTUM(env->env_prio);
+    }
+}
+
+/* Pin env priority to prio */
+void
+sched_set_priority(struct Env *env, unsigned prio) {
+    assert(prio < NPRIO);
+
+    bool queued = env->env_status == ENV_RUNNABLE;
+    if (queued) sched_dequeue(env);
+
+    env->env_prio = prio;
+    env->env_prio_pinned = 1;
+    env->env_slice = SCHED_QUANTUM(prio);
+
+    if (queued) sched_enqueue(env);
+}
+
+/* Make timeout be called for env blocked on this CPU in ns nanoseconds
+ * unless sched_clear_timeout() is called before.
+ * The CPU programs its timer for the deadline (see sched_timer_update()) */
+void
+sched_set_timeout(struct Env *env, uint64_t ns, void (*timeout)(struct Env *env)) {
+    sched_clear_timeout(env);
+
+    env->env_deadline = read_tsc() + ns2tsc(ns);
+    env->env_timeout = timeout;
+    list_append(sched_timed.prev, &env->env_timed);
+}
+
+void
+sched_clear_timeout(struct Env *env) {
+    list_del(&env->env_timed);
+}
+
+/* Call timeouts of environments which deadlines have passed */
+static void
+sched_expire(void) {
+    uint64_t now = read_tsc();
+    for (struct List *li = sched_timed.next, *next; li != &sched_timed; li = next) {
+        next = li->next;
+        struct Env *env = LIST_ENTRY(li, struct Env, env_timed);
+        if (env->env_deadline > now) continue;
+
+        list_del(&env->env_timed);
+        env->env_timeout(env);
+        /* Timeout could have removed other entries */
+        next = sched_timed.next;
+    }
+}
+
+/* Earliest deadline of the environments blocked
+ * on CPU cpunum (0 if none of them has timeout) */
+static uint64_t
+sched_next_timeout(int cpunum) {
+    uint64_t deadline = 0;
+    for (struct List *li = sched_timed.next; li != &sched_timed; li = li->next) {
+        struct Env *env = LIST_ENTRY(li, struct Env, env_timed);
+        if (env->env_cpunum == cpunum && (!deadline || env->env_deadline < deadline))
+            deadline = env->env_deadline;
+    }
+    return deadline;
+}
+
+/* Charge the running environment one timer tick.
+ * It is preempted when its quantum expires (and then demoted)
+ * or when environment of higher priority becomes runnable,
+ * otherwise this function returns and it keeps running */
+void
+sched_tick(void) {
+    /* One-shot timer has fired */
+    thiscpu->cpu_timer_deadline = 0;
+
+    sched_expire();
+
+    uint64_t now = read_tsc();
+    if (now - sched_boost_tsc >= ns2tsc(SCHED_BOOST_TICKS * SCHED_TICK_NS)) {
+        sched_boost_tsc = now;
+        sched_boost();
+    }
+
+    if (!curenv || curenv->env_status != ENV_RUNNING)
+        sched_yield();
+
+    /* Environment running alone is not charged */
+    if (!thiscpu->cpu_nrunnable) return;
+
+    sched_apply_boost(curenv);
+    if (curenv->env_slice) curenv->env_slice--;
+
+    if (!curenv->env_slice) {
+        if (!curenv->env_prio_pinned && curenv->env_prio < ENV_PRIO_LOW)
+            curenv->env_prio++;
+        curenv->env_slice = SCHED_QUANTUM(curenv->env_prio);
+        sched_preempt();
+    }
+
+    if (thiscpu->cpu_runq_mask & ((1U << curenv->env_prio) - 1))
+        sched_preempt();
+}
+
+/* Program timer of this CPU for the next event scheduler needs:
+ * end of the current tick if there are environments waiting
+ * for this CPU and wait timeouts of the environments blocked
+ * on this CPU. Idle CPU has no timer interrupts otherwise */
+void
+sched_timer_update(void) {
+    struct CpuInfo *cpu = thiscpu;
+    struct Timer *timer = cpu->cpu_timer;
+    if (!timer || !timer->set_oneshot) return;
+
+    uint64_t now = read_tsc();
+    uint64_t deadline = 0;
+    if (cpu->cpu_nrunnable)
+        deadline = now + ns2tsc(SCHED_TICK_NS);
+
+    uint64_t timeout = sched_next_timeout(cpu - cpus);
+    if (timeout && (!deadline || timeout < deadline)) deadline = timeout;
+
+    if (!deadline) {
+        if (cpu->cpu_timer_deadline) timer->stop();
+        cpu->cpu_timer_deadline = 0;
+        return;
+    }
+
+    /* Timer that is already going to fire earlier is
+     * left intact, otherwise frequent kernel entries
+     * would postpone the tick forever */
+    if (cpu->cpu_timer_deadline && cpu->cpu_timer_deadline <= deadline) return;
+
+    timer->set_oneshot(deadline > now ? tsc2ns(deadline - now) : 0);
+    cpu->cpu_timer_deadline = deadline;
+}
+
+/* Switch from the current environment directly to env blocked
+ * on this CPU which it has just woken up (IPC handoff).
+ * Current environment donates rest of its quantum to env and
+ * is left with none, so if it is still running it is queued
+ * behind the others as if its quantum had expired (see env_run()).
+ * No other CPU is kicked, env is going to run right now */
+_Noreturn void
+sched_handoff(struct Env *env) {
+    assert(env->env_status == ENV_NOT_RUNNABLE && env->env_cpunum == cpunum());
+
+    sched_apply_boost(env);
+    if (curenv && curenv->env_slice) {
+        env->env_slice = curenv->env_slice;
+        curenv->env_slice = 0;
+    }
+    if (curenv && curenv->env_status == ENV_RUNNING)
+        curenv->env_nivcsw++;
+
+    sched_queue(env);
+    env->env_status = ENV_RUNNABLE;
+    env_run(env);
+}
+
+/* Same as sched_yield() but the current environment
+ * is counted as preempted if it has to stop running */
+_Noreturn void
+sched_preempt(void) {
+    /* Queued environments are always chosen first */
+    if (curenv && curenv->env_status == ENV_RUNNING && thiscpu->cpu_runq_mask)
+        curenv->env_nivcsw++;
+    sched_yield();
+}
+
 /* Choose a user environment to run and run it */
 _Noreturn void
 sched_yield(void) {
-    /* Implement simple round-robin scheduling.
+    /* Multi-level feedback queue scheduling.
      *
-     * Search through 'envs' for an ENV_RUNNABLE environment in
-     * circular fashion starting just after the env was
-     * last running.  Switch to the first such environment found.
+     * Every ENV_RUNNABLE environment is linked into the run queue
+     * of its priority level (see env_set_status()), and the environment
+     * that stops running is appended to its tail by env_run(),
+     * so the head of the highest non-empty queue is the environment
+     * of the highest priority that waited the longest.
      *
      * If no envs are runnable, but the environment previously
      * running is still ENV_RUNNING, it's okay to
      * choose that environment.
      *
+     * Otherwise try to steal an environment queued to another CPU.
+     *
      * If there are no runnable environments,
      * simply drop through to the code
      * below to halt the cpu */
 
-    // LAB 3: Your code here:
-
-    struct Env *env;
-
-    if (curenv == NULL) {
-        curenv = &envs[NENV - 1];
+    struct CpuInfo *cpu = thiscpu;
+    if (cpu->cpu_runq_mask) {
+        struct List *queue = &cpu->cpu_runq[__builtin_ctz(cpu->cpu_runq_mask)];
+        env_run(LIST_ENTRY(queue->next, struct Env, env_runq));
     }
 
-    env = &envs[(curenv - envs + 1) % NENV];
-    
-    while ((env != curenv) && (env->env_status != ENV_RUNNABLE)) {
-        env = &envs[(env - envs + 1) % NENV];
-    }
+    if (curenv && curenv->env_status == ENV_RUNNING)
+        env_run(curenv);
 
-    if ((env->env_status == ENV_RUNNABLE) || (env->env_status == ENV_RUNNING)) {
-        env_run(env);
-    }
-    cprintf("Halt\n");
+    struct Env *env = sched_steal();
+    if (env) env_run(env);
+
+    if (cpu == bootcpu) cprintf("Halt\n");
 
     /* No runnable environments,
      * so just halt the cpu */
@@ -55,11 +386,13 @@ sched_halt(void) {
 
     /* For debugging and testing purposes, if there are no runnable
      * environments in the system, then drop into the kernel monitor */
-    int i;
-    for (i = 0; i < NENV; i++)
-        if (envs[i].env_status == ENV_RUNNABLE ||
-            envs[i].env_status == ENV_RUNNING) break;
-    if (i == NENV) {
+    bool idle = 1;
+    for (struct CpuInfo *cpu = cpus; cpu < cpus + ncpu; cpu++) {
+        struct Env *env = cpu->cpu_env;
+        if (cpu->cpu_runq_mask || (env && (env->env_status == ENV_RUNNING || env->env_status == ENV_DYING)))
+            idle = 0;
+    }
+    if (idle) {
         cprintf("No runnable environments in the system!\n");
         for (;;) monitor(NULL);
     }
@@ -67,6 +400,28 @@ sched_halt(void) {
     /* Mark that no environment is running on CPU */
     curenv = NULL;
 
+    /* Address space of the environment that was running here
+     * can be freed by other CPU while this one is halted */
+    switch_address_space(&kspace);
+
+    /* Use idle time to zero pages for future page faults
+     * and to map memory with huge pages where possible */
+    zero_pool_fill();
+    if (envs) huge_collapse_scan();
+
+    /* Nothing to preempt, stop ticking */
+    sched_timer_update();
+    thiscpu->cpu_idle_start = read_tsc();
+
+    /* Mark that this CPU is in the HALT state, so that when
+     * timer interupt comes in, we know we should re-acquire the
+     * big kernel lock */
+    uintptr_t rsp0 = thiscpu->cpu_ts.ts_rsp0;
+    xchg(&thiscpu->cpu_status, CPU_HALTED);
+
+    /* Release the big kernel lock as if we were "leaving" the kernel */
+    unlock_kernel();
+
     /* Reset stack pointer, enable interrupts and then halt */
     asm volatile(
             "movq $0, %%rbp\n"
@@ -74,7 +429,7 @@ sched_halt(void) {
             "pushq $0\n"
             "pushq $0\n"
             "sti\n"
-            "hlt\n" ::"a"(cpu_ts.ts_rsp0));
+            "hlt\n" ::"a"(rsp0));
 
     /* Unreachable */
     for (;;);
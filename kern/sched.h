@@ -6,6 +6,19 @@
 #error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
+void sched_init(void);
 _Noreturn void sched_yield(void);
+_Noreturn void sched_preempt(void);
+_Noreturn void sched_handoff(struct Env *env);
+void sched_tick(void);
+void sched_timer_update(void);
+void sched_enqueue(struct Env *env);
+void sched_dequeue(struct Env *env);
+void sched_promote(struct Env *env);
+void sched_set_priority(struct Env *env, unsigned prio);
+void sched_set_timeout(struct Env *env, uint64_t ns, void (*timeout)(struct Env *env));
+void sched_clear_timeout(struct Env *env);
 
 #endif /* !JOS_KERN_SCHED_H */
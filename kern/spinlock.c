@@ -7,6 +7,7 @@
 #include <inc/string.h>
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
+#include <kern/pmap.h>
 #include <kern/traceopt.h>
 
 /* The big kernel lock */
@@ -67,6 +68,22 @@ spin_lock(struct spinlock *lk) {
 #endif
 }
 
+/* Acquire the big kernel lock.
+ * Its holder can be waiting for this CPU to flush TLB
+ * (see tlb_shootdown()), interrupts are disabled here,
+ * so the request is served while spinning */
+void
+lock_kernel(void) {
+    while (xchg(&kernel_lock.locked, 1)) {
+        tlb_shootdown_serve();
+        asm volatile("pause");
+    }
+
+#if trace_spinlock
+    get_caller_pcs(kernel_lock.pcs);
+#endif
+}
+
 /* Release the lock. */
 void
 spin_unlock(struct spinlock *lk) {
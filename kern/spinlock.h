@@ -24,10 +24,7 @@ void spin_unlock(struct spinlock *lk);
 
 extern struct spinlock kernel_lock;
 
-static inline void
-lock_kernel(void) {
-    spin_lock(&kernel_lock);
-}
+void lock_kernel(void);
 
 static inline void
 unlock_kernel(void) {
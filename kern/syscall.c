@@ -7,13 +7,18 @@
 
 #include <kern/console.h>
 #include <kern/env.h>
+#include <kern/futex.h>
 #include <kern/kclock.h>
+#include <kern/list.h>
 #include <kern/pmap.h>
 #include <kern/sched.h>
 #include <kern/syscall.h>
 #include <kern/trap.h>
 #include <kern/traceopt.h>
 
+/* Allocated and mapped to USYSSTAT by env_init() */
+struct Sysstat *sysstat;
+
 /* Print a string to the system console.
  * The string is exactly 'len' characters long.
  * Destroys the environment on memory errors. */
@@ -72,14 +77,60 @@ sys_env_destroy(envid_t envid) {
                 curenv->env_id, env->env_id);
     }
 #endif
+    if (env == curenv) env->env_exit_status = 0;
+
     env_destroy(env);
     return 0;
 }
 
+/* Destroy the current environment, its parent gets
+ * status from sys_env_wait(). Does not return */
+static void
+sys_env_exit(int status) {
+    if (trace_envs) cprintf("[%08x] exiting gracefully\n", curenv->env_id);
+
+    curenv->env_exit_status = status;
+    env_destroy(curenv);
+}
+
+/* Block until child environment envid exits.
+ * Exit status of the child is stored in env_wait_status field
+ * of the caller's struct Env: the one passed to sys_env_exit(),
+ * 0 if it has destroyed itself with sys_env_destroy() or
+ * ENV_EXIT_KILLED if it has been destroyed by somebody else.
+ *
+ * Freed environment slot keeps the status until it is reused,
+ * so exit of a child that has already happened is reported as well.
+ *
+ * This function only returns if the child has already exited or
+ * on error, but the system call will eventually return 0 on success.
+ * Return < 0 on error. Errors are:
+ *  -E_BAD_ENV if envid is not a child of the caller
+ *      or it has exited and its slot has been reused. */
+static int
+sys_env_wait(envid_t envid) {
+    struct Env *env = &envs[ENVX(envid)];
+    if (env->env_id != envid || env->env_parent_id != curenv->env_id)
+        return -E_BAD_ENV;
+
+    if (env->env_status == ENV_FREE) {
+        curenv->env_wait_status = env->env_exit_status;
+        return 0;
+    }
+
+    curenv->env_wait_for = envid;
+    env_set_status(curenv, ENV_NOT_RUNNABLE);
+    curenv->env_tf.tf_regs.reg_rax = 0;
+    sched_yield();
+
+    return 0;
+}
+
 /* Deschedule current environment and pick a different one to run. */
 static void
 sys_yield(void) {
     // LAB 9: Your code here
+    if (thiscpu->cpu_runq_mask) curenv->env_nvcsw++;
     sched_yield();
 }
 
@@ -101,7 +152,7 @@ sys_exofork(void) {
     int status = env_alloc(&env, curenv->env_id, ENV_TYPE_USER);
     if (status)
         return status;
-    env->env_status = ENV_NOT_RUNNABLE;
+    env_set_status(env, ENV_NOT_RUNNABLE);
     env->env_tf = curenv->env_tf;
     env->env_tf.tf_regs.reg_rax = 0;
 
@@ -109,13 +160,33 @@ sys_exofork(void) {
     return 0;
 }
 
+/* Resume env blocked in a system call before the call completes:
+ * it leaves every queue it waits in, and the call returns -E_AGAIN.
+ * Newly created environment is not waiting and keeps its return value */
+static void
+env_interrupt(struct Env *env) {
+    bool waiting = !list_empty(&env->env_ipc_link) || !list_empty(&env->env_futex) ||
+                   env->env_ipc_recving || env->env_wait_for;
+
+    list_del(&env->env_ipc_link);
+    env->env_ipc_calling = 0;
+    env->env_ipc_recving = 0;
+    env->env_wait_for = 0;
+    futex_cancel(env);
+    sched_clear_timeout(env);
+
+    if (waiting) env->env_tf.tf_regs.reg_rax = -E_AGAIN;
+}
+
 /* Set envid's env_status to status, which must be ENV_RUNNABLE
- * or ENV_NOT_RUNNABLE.
+ * or ENV_NOT_RUNNABLE. Blocked environment made runnable
+ * is interrupted (see env_interrupt()).
  *
  * Returns 0 on success, < 0 on error.  Errors are:
  *  -E_BAD_ENV if environment envid doesn't currently exist,
  *      or the caller doesn't have permission to change envid.
- *  -E_INVAL if status is not a valid status for an environment. */
+ *  -E_INVAL if status is not a valid status for an environment,
+ *      or envid is running on another CPU. */
 static int
 sys_env_set_status(envid_t envid, int status) {
     /* Hint: Use the 'envid2env' function from kern/env.c to translate an
@@ -130,13 +201,21 @@ sys_env_set_status(envid_t envid, int status) {
     if (envid2env(envid, &env, 1))
         return -E_BAD_ENV;
 
-    if (status == ENV_NOT_RUNNABLE || status == ENV_RUNNABLE)
-        env->env_status = status;
-    else
+    if (status != ENV_NOT_RUNNABLE && status != ENV_RUNNABLE)
         return -E_INVAL;
 
-    return 0;
+    /* Environment running on another CPU can't be queued
+     * or stopped from here, it owns its trapframe until it traps */
+    if (env != curenv && (env->env_status == ENV_RUNNING || env->env_status == ENV_DYING))
+        return -E_INVAL;
 
+    /* Current environment is already running */
+    if (env == curenv && status == ENV_RUNNABLE)
+        return 0;
+
+    if (env->env_status == ENV_NOT_RUNNABLE && status == ENV_RUNNABLE)
+        env_interrupt(env);
+    env_set_status(env, status);
     return 0;
 }
 
@@ -317,6 +396,162 @@ sys_map_physical_region(uintptr_t pa, envid_t envid, uintptr_t va, size_t size,
 
     return res;
 }
+
+/* Pass message from env 'from' to env 'to' that is blocked receiving
+ * (see sys_ipc_try_send()), 'to' is not woken up */
+static int
+ipc_deliver(struct Env *from, struct Env *to, uint32_t value, uintptr_t srcva, size_t size, int perm) {
+    if (!to->env_ipc_recving)
+        return -E_IPC_NOT_RECV;
+    if (to->env_ipc_want && to->env_ipc_want != from->env_id)
+        return -E_IPC_NOT_RECV;
+
+    if (srcva < MAX_USER_ADDRESS && to->env_ipc_dstva < MAX_USER_ADDRESS) {
+        size = MIN(size, to->env_ipc_maxsz);
+        if (PAGE_OFFSET(srcva) || PAGE_OFFSET(size) || !size)
+            return -E_INVAL;
+        if (MAX_USER_ADDRESS - srcva < size)
+            return -E_INVAL;
+        if (PAGE_OFFSET(to->env_ipc_dstva))
+            return -E_INVAL;
+        if (perm & ~PROT_ALL)
+            return -E_INVAL;
+        if (map_region(&to->address_space, to->env_ipc_dstva,
+                       &from->address_space, srcva, size, perm | PROT_USER_))
+            return -E_NO_MEM;
+        to->env_ipc_maxsz = size;
+        to->env_ipc_perm = perm;
+    } else
+        to->env_ipc_perm = 0;
+
+    to->env_ipc_value = value;
+    to->env_ipc_from = from->env_id;
+    to->env_ipc_recving = 0;
+    to->env_ipc_want = 0;
+
+    from->env_nipcsent++;
+    to->env_nipcrecv++;
+    return 0;
+}
+
+/* Make receiver env that got the message runnable.
+ *
+ * Receiver waiting on this CPU runs right away on the rest of
+ * the quantum of the current environment instead of waiting
+ * its turn in the run queue (this function does not return then),
+ * receivers of other CPUs are woken up there */
+static void
+ipc_wake(struct Env *env) {
+    if (env->env_status != ENV_NOT_RUNNABLE) return;
+
+    if (env->env_cpunum == cpunum()) sched_handoff(env);
+
+    env_set_status(env, ENV_RUNNABLE);
+}
+
+static int
+ipc_check_recv(uintptr_t dstva, size_t maxsize) {
+    if (PAGE_OFFSET(maxsize) ||
+        (dstva < MAX_USER_ADDRESS && (PAGE_OFFSET(dstva) || maxsize == 0)))
+        return -E_INVAL;
+    if (dstva < MAX_USER_ADDRESS && MAX_USER_ADDRESS - dstva < maxsize)
+        return -E_INVAL;
+    return 0;
+}
+
+/* Remove blocked sender env from the queue of its receiver.
+ * Its system call returns res, or it starts waiting
+ * for the reply if it has been sent by sys_ipc_call() */
+static void
+ipc_unqueue(struct Env *env, int res) {
+    list_del(&env->env_ipc_link);
+    sched_clear_timeout(env);
+    if (env->env_status != ENV_NOT_RUNNABLE) return;
+
+    bool calling = env->env_ipc_calling;
+    env->env_ipc_calling = 0;
+    if (!res && calling) {
+        env->env_ipc_recving = 1;
+        env->env_ipc_want = env->env_ipc_to;
+        return;
+    }
+
+    env->env_tf.tf_regs.reg_rax = res;
+    env_set_status(env, ENV_RUNNABLE);
+}
+
+static void
+ipc_send_timeout(struct Env *env) {
+    ipc_unqueue(env, -E_TIMEOUT);
+}
+
+/* Queue current environment to the senders of 'to' until it receives.
+ * If timeout is not 0, sending is interrupted after timeout nanoseconds */
+static void
+ipc_enqueue(struct Env *to, uint32_t value, uintptr_t srcva, size_t size, int perm, uint64_t timeout) {
+    curenv->env_ipc_to = to->env_id;
+    curenv->env_ipc_send_value = value;
+    curenv->env_ipc_send_va = srcva;
+    curenv->env_ipc_send_size = size;
+    curenv->env_ipc_send_perm = perm;
+    list_del(&curenv->env_ipc_link);
+    list_append(to->env_ipc_senders.prev, &curenv->env_ipc_link);
+    if (timeout) sched_set_timeout(curenv, timeout, ipc_send_timeout);
+
+    curenv->env_tf.tf_regs.reg_rax = 0;
+    env_set_status(curenv, ENV_NOT_RUNNABLE);
+}
+
+/* Take the message of the first queued sender current
+ * environment accepts. Returns whether it has been received */
+static bool
+ipc_receive_queued(void) {
+    struct List *queue = &curenv->env_ipc_senders;
+    for (struct List *li = queue->next, *next; li != queue; li = next) {
+        next = li->next;
+        struct Env *from = LIST_ENTRY(li, struct Env, env_ipc_link);
+        if (curenv->env_ipc_want && curenv->env_ipc_want != from->env_id) continue;
+
+        int res = ipc_deliver(from, curenv, from->env_ipc_send_value, from->env_ipc_send_va,
+                              from->env_ipc_send_size, from->env_ipc_send_perm);
+        ipc_unqueue(from, res);
+        if (!res) return 1;
+    }
+    return 0;
+}
+
+/* Make current environment receive message from 'from' (any if 0)
+ * at 'dstva'. Queued sender is served first, otherwise current
+ * environment is blocked. The system call returns 0 when the message arrives.
+ * Returns whether current environment has been blocked */
+static bool
+ipc_block(uintptr_t dstva, size_t maxsize, envid_t from) {
+    curenv->env_ipc_recving = 1;
+    curenv->env_ipc_want = from;
+    curenv->env_ipc_dstva = dstva;
+    curenv->env_ipc_maxsz = maxsize;
+    curenv->env_tf.tf_regs.reg_rax = 0;
+    if (ipc_receive_queued()) return 0;
+
+    env_set_status(curenv, ENV_NOT_RUNNABLE);
+    sched_promote(curenv);
+    return 1;
+}
+
+/* Release IPC state of env that is being freed:
+ * it leaves the queue it is sending to, and
+ * the environments queued sending to it fail with -E_BAD_ENV */
+void
+ipc_cancel(struct Env *env) {
+    list_del(&env->env_ipc_link);
+    env->env_ipc_calling = 0;
+
+    while (!list_empty(&env->env_ipc_senders)) {
+        struct Env *from = LIST_ENTRY(env->env_ipc_senders.next, struct Env, env_ipc_link);
+        ipc_unqueue(from, -E_BAD_ENV);
+    }
+}
+
 /* Try to send 'value' to the target env 'envid'.
  * If srcva < MAX_USER_ADDRESS, then also send region currently mapped at 'srcva',
  * so that receiver gets mapping.
@@ -349,6 +584,7 @@ sys_map_physical_region(uintptr_t pa, envid_t envid, uintptr_t va, size_t size,
  *  -E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
  *      or another environment managed to send first.
  *  -E_INVAL if srcva < MAX_USER_ADDRESS but srcva is not page-aligned.
+ *  -E_INVAL if srcva < MAX_USER_ADDRESS but size is not page-aligned or zero.
  *  -E_INVAL if srcva < MAX_USER_ADDRESS and perm is inappropriate
  *      (see sys_page_alloc).
  *  -E_INVAL if srcva < MAX_USER_ADDRESS but srcva is not mapped in the caller's
@@ -365,29 +601,46 @@ sys_ipc_try_send(envid_t envid, uint32_t value, uintptr_t srcva, size_t size, in
     if (envid2env(envid, &env, 0))
         return -E_BAD_ENV;
 
-    if (!env->env_ipc_recving)
-        return -E_IPC_NOT_RECV;
+    int res = ipc_deliver(curenv, env, value, srcva, size, perm);
+    if (res < 0) return res;
 
-    if (srcva < MAX_USER_ADDRESS && env->env_ipc_dstva < MAX_USER_ADDRESS) {
-        if (PAGE_OFFSET(srcva))
-            return -E_INVAL;
-        if (PAGE_OFFSET(env->env_ipc_dstva))
-            return -E_INVAL;
-        if (perm & ~PROT_ALL)
-            return -E_INVAL;
-        if (map_region(&env->address_space, env->env_ipc_dstva,
-                       &curenv->address_space, srcva, PAGE_SIZE, perm | PROT_USER_))
-            return -E_NO_MEM;
-        env->env_ipc_maxsz = MIN(size, env->env_ipc_maxsz);
-        env->env_ipc_perm = perm;
-    } else
-        env->env_ipc_perm = 0;
+    curenv->env_tf.tf_regs.reg_rax = 0;
+    ipc_wake(env);
+    return 0;
+}
 
-    env->env_ipc_value = value;
-    env->env_ipc_from = curenv->env_id;
-    env->env_ipc_recving = 0;
-    env->env_status = ENV_RUNNABLE;
+/* Send 'value' (and region at 'srcva') to 'envid' just like
+ * sys_ipc_try_send() does, but if 'envid' is not receiving,
+ * block until it does instead of failing with -E_IPC_NOT_RECV.
+ * Blocked senders are queued to the receiver and served
+ * in FIFO order by sys_ipc_recv().
+ * If timeout is not 0, the send is interrupted after
+ * timeout nanoseconds.
+ *
+ * This function only returns if the message is delivered right away
+ * or on error, but the system call returns 0 once it is delivered.
+ * Return < 0 on error. Errors are those of sys_ipc_try_send() except
+ * -E_IPC_NOT_RECV, and:
+ *  -E_INVAL if envid is the caller itself.
+ *  -E_TIMEOUT if the timeout expired.
+ *  -E_BAD_ENV if envid has exited while the caller was blocked. */
+static int
+sys_ipc_send(envid_t envid, uint32_t value, uintptr_t srcva, size_t size, int perm, uint64_t timeout) {
+    struct Env *env;
+    if (envid2env(envid, &env, 0))
+        return -E_BAD_ENV;
+    if (env == curenv)
+        return -E_INVAL;
+
+    int res = ipc_deliver(curenv, env, value, srcva, size, perm);
+    if (res == -E_IPC_NOT_RECV) {
+        ipc_enqueue(env, value, srcva, size, perm, timeout);
+        sched_yield();
+    }
+    if (res < 0) return res;
 
+    curenv->env_tf.tf_regs.reg_rax = 0;
+    ipc_wake(env);
     return 0;
 }
 
@@ -408,21 +661,92 @@ static int
 sys_ipc_recv(uintptr_t dstva, uintptr_t maxsize) {
     // LAB 9: Your code here
 
-    if (PAGE_OFFSET(maxsize) ||
-        (dstva < MAX_USER_ADDRESS && (PAGE_OFFSET(dstva) || maxsize == 0)))
+    int res = ipc_check_recv(dstva, maxsize);
+    if (res < 0) return res;
+
+    if (ipc_block(dstva, maxsize, 0)) sched_yield();
+
+    return 0;
+}
+
+/* Send 'value' (and region at 'srcva') to 'envid' just like
+ * sys_ipc_send() does (without timeout) and block until it replies,
+ * as if sys_ipc_recv(dstva, size) were called, but only accepting
+ * the message from 'envid'. The caller starts waiting for
+ * the reply as soon as the value is delivered,
+ * so no reply can be missed.
+ *
+ * This function only returns on error, but the system call will
+ * eventually return 0 when the reply is received.
+ * Return < 0 on error. Errors are those of sys_ipc_send()
+ * and sys_ipc_recv(). */
+static int
+sys_ipc_call(envid_t envid, uint32_t value, uintptr_t srcva, size_t size, int perm, uintptr_t dstva) {
+    int res = ipc_check_recv(dstva, size);
+    if (res < 0) return res;
+
+    struct Env *env;
+    if (envid2env(envid, &env, 0))
+        return -E_BAD_ENV;
+    if (env == curenv)
         return -E_INVAL;
-    curenv->env_ipc_recving = 1;
-    curenv->env_status = ENV_NOT_RUNNABLE;
-    if (dstva < MAX_USER_ADDRESS) {
+
+    res = ipc_deliver(curenv, env, value, srcva, size, perm);
+    if (res == -E_IPC_NOT_RECV) {
+        /* Reply is going to be received at dstva (see ipc_unqueue()) */
         curenv->env_ipc_dstva = dstva;
-        curenv->env_ipc_maxsz = maxsize;
+        curenv->env_ipc_maxsz = size;
+        curenv->env_ipc_calling = 1;
+        ipc_enqueue(env, value, srcva, size, perm, 0);
+        sched_yield();
     }
-    curenv->env_tf.tf_regs.reg_rax = 0;
+    if (res < 0) return res;
+
+    ipc_block(dstva, size, envid);
+    ipc_wake(env);
     sched_yield();
 
     return 0;
 }
 
+/* Reply 'value' (and region at 'srcva') to 'envid' (unless it is 0)
+ * just like sys_ipc_try_send() does and block until next message
+ * from any environment arrives as if sys_ipc_recv(dstva, size) were called.
+ * Region mapped at 'dstva' (the previous message) is unmapped.
+ *
+ * This is the server side of sys_ipc_call(): clients are blocked
+ * waiting for the reply, so the server is going to wait for
+ * the next request within the same system call.
+ *
+ * This function only returns on error (in which case nothing is
+ * received), but the system call will eventually return 0
+ * when the next message is received.
+ * Return < 0 on error. Errors are those of sys_ipc_try_send()
+ * and sys_ipc_recv(). */
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, uintptr_t srcva, size_t size, int perm, uintptr_t dstva) {
+    int res = ipc_check_recv(dstva, size);
+    if (res < 0) return res;
+
+    struct Env *env = NULL;
+    if (envid) {
+        if (envid2env(envid, &env, 0))
+            return -E_BAD_ENV;
+
+        res = ipc_deliver(curenv, env, value, srcva, size, perm);
+        if (res < 0) return res;
+    }
+
+    if (dstva < MAX_USER_ADDRESS)
+        unmap_region(&curenv->address_space, dstva, size);
+
+    bool blocked = ipc_block(dstva, size, 0);
+    if (env) ipc_wake(env);
+    if (blocked) sched_yield();
+
+    return 0;
+}
+
 /*
  * This function sets trapframe and is unsafe
  * so you need:
@@ -439,9 +763,13 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe* tf) {
     if (envid2env(envid, &env, true))
         return -E_BAD_ENV;
 
-    size_t tfs = sizeof(struct Trapframe);
-    user_mem_assert(env, tf, tfs, PROT_R | PROT_USER_);
-    nosan_memcpy((void*)&env->env_tf, (void*)tf, tfs);
+    /* Copy it aside first, so that a bad pointer does not clobber env */
+    struct Trapframe ktf;
+    if (copyin(&ktf, tf, sizeof(ktf)) < 0) {
+        user_mem_fault(curenv);
+        return -E_FAULT;
+    }
+    env->env_tf = ktf;
 
     env->env_tf.tf_ds = GD_UD | 3;
     env->env_tf.tf_es = GD_UD | 3;
@@ -455,6 +783,94 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe* tf) {
     return 0;
 }
 
+/* Pin envid's scheduling priority to 'prio'.
+ * Pinned environments are neither demoted when their quantum
+ * expires nor boosted, so servers can be kept at high priority.
+ * An environment pinned high could starve all the others, so only
+ * the file system server and the parent of envid can raise it,
+ * the others can only lower their priority.
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist,
+ *      or the caller doesn't have permission to change envid
+ *      or to raise its priority.
+ *  -E_INVAL if prio is not within [ENV_PRIO_HIGH, ENV_PRIO_LOW]. */
+static int
+sys_env_set_priority(envid_t envid, int prio) {
+    struct Env *env;
+    if (envid2env(envid, &env, 1))
+        return -E_BAD_ENV;
+
+    if (prio < ENV_PRIO_HIGH || prio > ENV_PRIO_LOW)
+        return -E_INVAL;
+
+    bool privileged = curenv->env_type == ENV_TYPE_FS || env->env_parent_id == curenv->env_id;
+    if (!privileged && prio != ENV_PRIO_LOW && (unsigned)prio <= env->env_prio)
+        return -E_BAD_ENV;
+
+    sched_set_priority(env, prio);
+    return 0;
+}
+
+/* Set the number of pages following a sequential page fault
+ * that are resolved together with it in envid's address space
+ * (0 disables fault-around).
+ *
+ * Returns 0 on success, < 0 on error.  Errors are:
+ *  -E_BAD_ENV if environment envid doesn't currently exist,
+ *      or the caller doesn't have permission to change envid.
+ *  -E_INVAL if npages is greater than FAULT_AROUND_MAX. */
+static int
+sys_env_set_fault_around(envid_t envid, size_t npages) {
+    struct Env *env;
+    if (envid2env(envid, &env, 1))
+        return -E_BAD_ENV;
+
+    if (npages > FAULT_AROUND_MAX)
+        return -E_INVAL;
+
+    env->address_space.fault_around = npages * PAGE_SIZE;
+    return 0;
+}
+
+/* Block until the 32-bit word at addr is changed and
+ * sys_futex_wake() is called for it by some environment
+ * that maps the same memory (at any address).
+ * Nothing happens if the word is not equal to expected,
+ * so the check and the wait are atomic for the caller.
+ * If timeout is not 0, the wait is interrupted after
+ * timeout nanoseconds.
+ *
+ * This function only returns on error, but the system call
+ * returns 0 when woken up.
+ * Return < 0 on error. Errors are:
+ *  -E_INVAL if addr is not a user address aligned to 4 bytes.
+ *  -E_FAULT if addr is not mapped.
+ *  -E_AGAIN if the word is not equal to expected.
+ *  -E_TIMEOUT if the timeout expired. */
+static int
+sys_futex_wait(uintptr_t addr, uint32_t expected, uint64_t timeout) {
+    int res = futex_wait(curenv, addr, expected, timeout);
+    if (res < 0) return res;
+
+    sched_promote(curenv);
+    sched_yield();
+
+    return 0;
+}
+
+/* Wake up to count environments blocked in sys_futex_wait()
+ * on the word at addr.
+ *
+ * Returns the number of woken environments, < 0 on error
+ * (see sys_futex_wait()) */
+static int
+sys_futex_wake(uintptr_t addr, int count) {
+    if (count < 0) return -E_INVAL;
+
+    return futex_wake(curenv, addr, count);
+}
+
 /* Return date and time in UNIX timestamp format: seconds passed
  * from 1970-01-01 00:00:00 UTC. */
 static int
@@ -481,9 +897,67 @@ sys_region_refs(uintptr_t addr, size_t size, uintptr_t addr2, uintptr_t size2) {
     return region_maxref(current_space, addr, size) - region_maxref(current_space, addr2, size2);
 }
 
+/* System calls that return to the caller right away
+ * (without blocking or switching environments) */
+static bool
+batch_allowed(uint64_t syscallno) {
+    switch (syscallno) {
+    case SYS_cputs:
+    case SYS_getenvid:
+    case SYS_alloc_region:
+    case SYS_map_region:
+    case SYS_map_physical_region:
+    case SYS_unmap_region:
+    case SYS_region_refs:
+    case SYS_env_set_status:
+    case SYS_env_set_trapframe:
+    case SYS_env_set_pgfault_upcall:
+    case SYS_env_set_priority:
+    case SYS_env_set_fault_around:
+    case SYS_futex_wake:
+    case SYS_gettime:
+        return 1;
+    }
+    return 0;
+}
+
+/* Execute 'n' system calls described by 'calls' in order with
+ * a single trap, storing the return value of each one to its sb_res.
+ * Stops at the first call that fails (returns < 0).
+ * Calls that can block or switch environments are not allowed
+ * (they fail with -E_INVAL).
+ *
+ * Returns the number of calls that succeeded (n if all of them did),
+ * or < 0 on error:
+ *  -E_INVAL if n is greater than SYSBATCH_MAX. */
+static int
+sys_batch(struct SyscallBatch *calls, size_t n) {
+    if (n > SYSBATCH_MAX) return -E_INVAL;
+
+    for (size_t i = 0; i < n; i++) {
+        /* Array itself can be unmapped by the previous call */
+        struct SyscallBatch sb;
+        if (copyin(&sb, &calls[i], sizeof(sb)) < 0) goto fault;
+
+        int64_t res = -E_INVAL;
+        if (batch_allowed(sb.sb_num)) {
+            res = syscall(sb.sb_num, sb.sb_args[0], sb.sb_args[1], sb.sb_args[2],
+                          sb.sb_args[3], sb.sb_args[4], sb.sb_args[5]);
+        }
+        if (copyout(&calls[i].sb_res, &res, sizeof(res)) < 0) goto fault;
+        if (res < 0) return i;
+    }
+
+    return n;
+
+fault:
+    user_mem_fault(curenv);
+    return -E_FAULT;
+}
+
 /* Dispatches to the correct kernel function, passing the arguments. */
-uintptr_t
-syscall(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t a4, uintptr_t a5, uintptr_t a6) {
+static uintptr_t
+syscall_dispatch(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t a4, uintptr_t a5, uintptr_t a6) {
     /* Call the function corresponding to the 'syscallno' parameter.
      * Return any appropriate return value. */
 
@@ -518,6 +992,12 @@ syscall(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t
         return sys_ipc_try_send((envid_t)a1, (uint32_t)a2, a3, (size_t)a4, (int)a5);
     } else if (syscallno == SYS_ipc_recv) {
         return sys_ipc_recv(a1, a2);
+    } else if (syscallno == SYS_ipc_send) {
+        return sys_ipc_send((envid_t)a1, (uint32_t)a2, a3, (size_t)a4, (int)a5, (uint64_t)a6);
+    } else if (syscallno == SYS_ipc_call) {
+        return sys_ipc_call((envid_t)a1, (uint32_t)a2, a3, (size_t)a4, (int)a5, a6);
+    } else if (syscallno == SYS_ipc_reply_wait) {
+        return sys_ipc_reply_wait((envid_t)a1, (uint32_t)a2, a3, (size_t)a4, (int)a5, a6);
     } else if (syscallno == SYS_region_refs) {
         return sys_region_refs(a1, (size_t)a2, a3, a4);
     } else if (syscallno == SYS_map_physical_region) {
@@ -526,6 +1006,21 @@ syscall(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t
         return sys_env_set_trapframe((envid_t)a1, (struct Trapframe*)a2);
     } else if (syscallno == SYS_gettime) {
         return sys_gettime();
+    } else if (syscallno == SYS_env_set_priority) {
+        return sys_env_set_priority((envid_t)a1, (int)a2);
+    } else if (syscallno == SYS_env_wait) {
+        return sys_env_wait((envid_t)a1);
+    } else if (syscallno == SYS_futex_wait) {
+        return sys_futex_wait(a1, (uint32_t)a2, (uint64_t)a3);
+    } else if (syscallno == SYS_batch) {
+        return sys_batch((struct SyscallBatch *)a1, (size_t)a2);
+    } else if (syscallno == SYS_futex_wake) {
+        return sys_futex_wake(a1, (int)a2);
+    } else if (syscallno == SYS_env_set_fault_around) {
+        return sys_env_set_fault_around((envid_t)a1, (size_t)a2);
+    } else if (syscallno == SYS_env_exit) {
+        sys_env_exit((int)a1);
+        return 0;
     }
 
     // LAB 10: Your code here
@@ -534,3 +1029,28 @@ syscall(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t
 
     return -E_NO_SYS;
 }
+
+/* Account time spent in a system call (in TSC ticks) */
+static void
+sysstat_account(struct SyscallStat *stat, uint64_t ticks) {
+    int bucket = 63 - __builtin_clzll(ticks | 1) - SYSSTAT_SHIFT;
+
+    stat->ss_cycles += ticks;
+    stat->ss_hist[MIN(MAX(bucket, 0), SYSSTAT_NBUCKETS - 1)]++;
+}
+
+/* Calls syscall_dispatch() keeping statistics in sysstat.
+ * Calls which block never return here, only their count is updated */
+uintptr_t
+syscall(uintptr_t syscallno, uintptr_t a1, uintptr_t a2, uintptr_t a3, uintptr_t a4, uintptr_t a5, uintptr_t a6) {
+    if (syscallno >= NSYSCALLS) return -E_NO_SYS;
+
+    struct SyscallStat *stat = &sysstat->st_syscalls[syscallno];
+    stat->ss_count++;
+
+    uint64_t start = read_tsc();
+    uintptr_t res = syscall_dispatch(syscallno, a1, a2, a3, a4, a5, a6);
+    sysstat_account(stat, read_tsc() - start);
+
+    return res;
+}
@@ -51,6 +51,8 @@ struct Timer timer_hpet0 = {
         .get_cpu_freq = hpet_cpu_frequency,
         .enable_interrupts = hpet_enable_interrupts_tim0,
         .handle_interrupts = hpet_handle_interrupts_tim0,
+        .set_oneshot = hpet_set_oneshot_tim0,
+        .stop = hpet_stop_tim0,
 };
 
 struct Timer timer_hpet1 = {
@@ -59,6 +61,8 @@ struct Timer timer_hpet1 = {
         .get_cpu_freq = hpet_cpu_frequency,
         .enable_interrupts = hpet_enable_interrupts_tim1,
         .handle_interrupts = hpet_handle_interrupts_tim1,
+        .set_oneshot = hpet_set_oneshot_tim1,
+        .stop = hpet_stop_tim1,
 };
 
 struct Timer timer_acpipm = {
@@ -277,6 +281,12 @@ get_hpet(void) {
     return (HPET *)acpi_find_table("HPET");
 }
 
+/* Obtain and map MADT ACPI table describing interrupt controllers */
+MADT *
+get_madt(void) {
+    return (MADT *)acpi_find_table("APIC");
+}
+
 /* Getting physical HPET timer address from its table. */
 HPETRegister *
 hpet_register(void) {
@@ -394,6 +404,50 @@ hpet_enable_interrupts_tim1(void) {
     pic_irq_unmask(IRQ_CLOCK); // Снимаем маску прерывания
 }
 
+/* Smallest comparator distance that can't be missed
+ * while the comparator is being written */
+#define HPET_MIN_DELTA 64
+
+/* Switch timer to non-periodic mode and make it fire
+ * once in ns nanoseconds.
+ *
+ * Comparator match is checked for equality, so deadline
+ * that passed before it has been written would only be
+ * reached after main counter wraps around; retry with
+ * bigger distance in that case */
+static void
+hpet_set_oneshot(volatile uint64_t *conf, volatile uint64_t *comp, uint64_t ns) {
+    uint64_t delta = MAX(ns * hpetFreq / (1000 * Mega), HPET_MIN_DELTA);
+
+    *conf = (*conf & ~(HPET_TN_TYPE_CNF | HPET_TN_VAL_SET_CNF)) | HPET_TN_INT_ENB_CNF;
+    for (;;) {
+        uint64_t deadline = hpet_get_main_cnt() + delta;
+        *comp = deadline;
+        if ((int64_t)(deadline - hpet_get_main_cnt()) > 0) break;
+        delta *= 2;
+    }
+}
+
+void
+hpet_set_oneshot_tim0(uint64_t ns) {
+    hpet_set_oneshot(&hpetReg->TIM0_CONF, &hpetReg->TIM0_COMP, ns);
+}
+
+void
+hpet_set_oneshot_tim1(uint64_t ns) {
+    hpet_set_oneshot(&hpetReg->TIM1_CONF, &hpetReg->TIM1_COMP, ns);
+}
+
+void
+hpet_stop_tim0(void) {
+    hpetReg->TIM0_CONF &= ~HPET_TN_INT_ENB_CNF;
+}
+
+void
+hpet_stop_tim1(void) {
+    hpetReg->TIM1_CONF &= ~HPET_TN_INT_ENB_CNF;
+}
+
 void
 hpet_handle_interrupts_tim0(void) {
     pic_send_eoi(IRQ_TIMER);
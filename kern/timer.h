@@ -15,10 +15,16 @@ struct Timer {
     uint64_t (*get_cpu_freq)(void);  /* Get CPU frequency */
     void (*enable_interrupts)(void); /* Init timer interrupts */
     void (*handle_interrupts)(void);
+    void (*set_oneshot)(uint64_t ns); /* Fire single interrupt in ns nanoseconds */
+    void (*stop)(void);               /* Stop generating interrupts */
 };
 
 #define MAX_TIMERS 5
 
+/* Period of timer interrupts driving the scheduler
+ * (see hpet_enable_interrupts_tim0()) */
+#define SCHED_TICK_NS 500000000ULL
+
 extern struct Timer timertab[MAX_TIMERS];
 
 extern struct Timer timer_pit;
@@ -27,6 +33,7 @@ extern struct Timer timer_hpet0;
 extern struct Timer timer_hpet1;
 extern struct Timer timer_acpipm;
 extern struct Timer *timer_for_schedule;
+extern struct Timer timer_lapic;
 
 #pragma pack(push, 1)
 
@@ -190,12 +197,45 @@ typedef struct {
     CSBAA Data[];
 } MCFG;
 
+/* Multiple APIC Description Table entry types */
+#define MADT_LAPIC          0 /* Processor Local APIC */
+#define MADT_LAPIC_OVERRIDE 5 /* Local APIC Address Override */
+
+#define MADT_LAPIC_ENABLED        0x1
+#define MADT_LAPIC_ONLINE_CAPABLE 0x2
+
+typedef struct {
+    uint8_t Type;
+    uint8_t Length;
+} MADTEntry;
+
+typedef struct {
+    MADTEntry h;
+    uint8_t ProcessorId;
+    uint8_t ApicId;
+    uint32_t Flags;
+} MADTLocalApic;
+
+typedef struct {
+    MADTEntry h;
+    uint16_t Reserved;
+    uint64_t Address;
+} MADTLocalApicOverride;
+
+typedef struct {
+    ACPISDTHeader h;
+    uint32_t LocalApicAddress;
+    uint32_t Flags;
+    uint8_t Entries[];
+} MADT;
+
 #pragma pack(pop)
 
 void acpi_enable(void);
 RSDP *get_rsdp(void);
 FADT *get_fadt(void);
 HPET *get_hpet(void);
+MADT *get_madt(void);
 
 void hpet_print_struct(void);
 void hpet_init(void);
@@ -205,6 +245,10 @@ void hpet_enable_interrupts_tim1(void);
 uint64_t hpet_cpu_frequency(void);
 void hpet_handle_interrupts_tim0(void);
 void hpet_handle_interrupts_tim1(void);
+void hpet_set_oneshot_tim0(uint64_t ns);
+void hpet_set_oneshot_tim1(uint64_t ns);
+void hpet_stop_tim0(void);
+void hpet_stop_tim1(void);
 
 uint32_t pmtimer_get_timeval(void);
 uint64_t pmtimer_cpu_frequency(void);
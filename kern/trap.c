@@ -16,8 +16,16 @@
 #include <kern/timer.h>
 #include <kern/vsyscall.h>
 #include <kern/traceopt.h>
-
-static struct Taskstate ts;
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+/* trap() tells env traps from kernel traps by the CPL of the
+ * interrupted code and takes the big kernel lock only for the former.
+ * Kspace environments ran in ring 0 and called into the kernel without
+ * the lock, the build no longer offers them (CONFIG_KSPACE) */
+#ifdef CONFIG_KSPACE
+#error "CONFIG_KSPACE is not supported with the big kernel lock"
+#endif
 
 /* For debugging, so print_trapframe can distinguish between printing
  * a saved trapframe and printing the current trapframe and print some
@@ -55,10 +63,10 @@ struct Segdesc32 gdt[2 * NCPU + 7] = {
         [GD_KT32 >> 3] = SEG32(STA_X | STA_R, 0x0, 0xFFFFFFFF, 0),
         /* 0x20 - kernel data segment 32bit */
         [GD_KD32 >> 3] = SEG32(STA_W, 0x0, 0xFFFFFFFF, 0),
-        /* 0x28 - user code segment */
-        [GD_UT >> 3] = SEG64(STA_X | STA_R, 0x0, 0xFFFFFFFF, 3),
-        /* 0x30 - user data segment */
+        /* 0x28 - user data segment */
         [GD_UD >> 3] = SEG64(STA_W, 0x0, 0xFFFFFFFF, 3),
+        /* 0x30 - user code segment */
+        [GD_UT >> 3] = SEG64(STA_X | STA_R, 0x0, 0xFFFFFFFF, 3),
         /* Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
          * in trap_init_percpu() */
         [GD_TSS0 >> 3] = SEG_NULL,
@@ -69,7 +77,7 @@ struct Pseudodesc gdt_pd = {sizeof(gdt) - 1, (unsigned long)gdt};
 
 static _Noreturn void page_fault_handler(struct Trapframe *tf);
 
-static const char *
+const char *
 trapname(int trapno) {
     static const char *const excnames[] = {
             "Divide error",
@@ -122,6 +130,14 @@ void align_thdlr(void);
 void simderr_thdlr(void);
 void kbd_thdlr(void);
 void serial_thdlr(void);
+void spurious_thdlr(void);
+void lapic_timer_thdlr(void);
+void resched_thdlr(void);
+void tlb_shootdown_thdlr(void);
+void syscall_entry(void);
+
+/* SYSCALL/SYSRET instructions are supported by CPU */
+static bool syscall_supported;
 
 void
 trap_init(void) {
@@ -164,6 +180,17 @@ trap_init(void) {
 
     idt[IRQ_OFFSET + IRQ_KBD] = GATE(0, GD_KT, (uintptr_t)(&kbd_thdlr), 0);
     idt[IRQ_OFFSET + IRQ_SERIAL] = GATE(0, GD_KT, (uintptr_t)(&serial_thdlr), 0);
+    idt[IRQ_OFFSET + IRQ_SPURIOUS] = GATE(0, GD_KT, (uintptr_t)(&spurious_thdlr), 0);
+
+    /* Local APIC interrupts */
+    idt[IRQ_OFFSET + IRQ_LAPIC_TIMER] = GATE(0, GD_KT, (uintptr_t)(&lapic_timer_thdlr), 0);
+    idt[IRQ_OFFSET + IRQ_RESCHED] = GATE(0, GD_KT, (uintptr_t)(&resched_thdlr), 0);
+    idt[IRQ_OFFSET + IRQ_TLB_SHOOTDOWN] = GATE(0, GD_KT, (uintptr_t)(&tlb_shootdown_thdlr), 0);
+
+    /* SYSCALL is reported in CPUID leaf 0x80000001 like NX */
+    uint32_t edx;
+    cpuid(0x80000001, NULL, NULL, NULL, &edx);
+    syscall_supported = edx & (1 << 11);
 
     /* Per-CPU setup */
     trap_init_percpu();
@@ -198,19 +225,41 @@ trap_init_percpu(void) {
             : "cc", "memory");
 
     /* Setup a TSS so that we get the right stack
-     * when we trap to the kernel. */
-    ts.ts_rsp0 = KERN_STACK_TOP;
-    ts.ts_ist1 = KERN_PF_STACK_TOP;
+     * when we trap to the kernel. Every CPU has its own
+     * kernel and #PF stacks (see inc/memlayout.h) */
+    int i = cpunum();
+    struct Taskstate *ts = &thiscpu->cpu_ts;
+    ts->ts_rsp0 = KERN_STACK_TOP - i * KERN_STACK_STRIDE;
+    ts->ts_ist1 = KERN_PF_STACK_TOP - i * KERN_STACK_STRIDE;
 
-    /* Initialize the TSS slot of the gdt. */
-    *(volatile struct Segdesc64 *)(&gdt[(GD_TSS0 >> 3)]) = SEG64_TSS(STS_T64A, ((uint64_t)&ts), sizeof(struct Taskstate), 0);
+    /* Initialize the TSS slot of the gdt (TSS descriptor is 16 bytes long). */
+    uint16_t tss_sel = GD_TSS0 + (i << 4);
+    *(volatile struct Segdesc64 *)(&gdt[(tss_sel >> 3)]) = SEG64_TSS(STS_T64A, ((uint64_t)ts), sizeof(struct Taskstate), 0);
 
     /* Load the TSS selector (like other segment selectors, the
      * bottom three bits are special; we leave them 0) */
-    ltr(GD_TSS0);
+    ltr(tss_sel);
 
     /* Load the IDT */
     lidt(&idt_pd);
+
+    /* Setup SYSCALL entry (see syscall_entry). It switches to
+     * the kernel stack of this CPU found at GS base in kernel
+     * (user GS base is always 0). SYSRET takes user SS and CS
+     * from the descriptors following GD_UD - 8, interrupts
+     * stay disabled in kernel like with interrupt gates */
+    thiscpu->cpu_kstack = ts->ts_rsp0;
+    if (syscall_supported) {
+        static_assert(GD_UT == GD_UD + 8, "SYSRET requires user code segment to follow user data");
+        static_assert(offsetof(struct CpuInfo, cpu_kstack) == 0, "Offset is hardcoded in syscall_entry");
+        static_assert(offsetof(struct CpuInfo, cpu_user_rsp) == 8, "Offset is hardcoded in syscall_entry");
+
+        wrmsr(STAR_MSR, ((uint64_t)(GD_UD - 8) << 48) | ((uint64_t)GD_KT << 32));
+        wrmsr(LSTAR_MSR, (uintptr_t)syscall_entry);
+        wrmsr(SFMASK_MSR, FL_IF | FL_DF | FL_TF | FL_AC | FL_NT);
+        wrmsr(KERNEL_GS_BASE_MSR, (uintptr_t)thiscpu);
+        wrmsr(EFER_MSR, rdmsr(EFER_MSR) | EFER_SCE);
+    }
 }
 
 void
@@ -306,19 +355,33 @@ trap_dispatch(struct Trapframe *tf) {
         // LAb 5: Your code here
         // LAB 12: Your code here
         timer_for_schedule->handle_interrupts();
-        vsys[VSYS_gettime] = gettime();
-        sched_yield();
+        sched_tick();
+        return;
+    case IRQ_OFFSET + IRQ_LAPIC_TIMER:
+        timer_lapic.handle_interrupts();
+        sched_tick();
+        return;
+    case IRQ_OFFSET + IRQ_RESCHED:
+        /* Idle CPU is woken up to pick new environment,
+         * it is done below in trap() */
+        lapic_eoi();
+        return;
+    case IRQ_OFFSET + IRQ_TLB_SHOOTDOWN:
+        /* Shootdown that has already been served by
+         * this CPU before it halted (see trap()) */
+        lapic_eoi();
+        tlb_shootdown_serve();
         return;
         // LAB 11: Your code here
         /* Handle keyboard (IRQ_KBD + kbd_intr()) and
          * serial (IRQ_SERIAL + serial_intr()) interrupts. */
     case IRQ_OFFSET + IRQ_KBD:
         kbd_intr();
-        sched_yield();
+        sched_preempt();
         return;
     case IRQ_OFFSET + IRQ_SERIAL:
         serial_intr();
-        sched_yield();
+        sched_preempt();
         return;
     default:
         print_trapframe(tf);
@@ -328,9 +391,6 @@ trap_dispatch(struct Trapframe *tf) {
     }
 }
 
-/* We do not support recursive page faults in-kernel */
-bool in_page_fault;
-
 _Noreturn void
 trap(struct Trapframe *tf) {
     /* The environment may have set DF and some versions
@@ -347,6 +407,28 @@ trap(struct Trapframe *tf) {
      * the interrupt path */
     assert(!(read_rflags() & FL_IF));
 
+    /* TLB shootdown is requested by the holder of the big kernel lock
+     * and is waited for, so it is served without the lock. The idle
+     * CPU has kspace loaded and only picks up the stale interrupt */
+    if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB_SHOOTDOWN && thiscpu->cpu_status != CPU_HALTED) {
+        lapic_eoi();
+        tlb_shootdown_serve();
+        env_pop_tf(tf);
+    }
+
+    /* Acquire the big kernel lock when trapped from user mode or
+     * woken up in sched_halt(). Traps from kernel code are
+     * only possible while it is already held */
+    bool halted = xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED;
+    if (halted || (tf->tf_cs & 3) == 3) lock_kernel();
+    if (halted) thiscpu->cpu_idle_tsc += read_tsc() - thiscpu->cpu_idle_start;
+
+    /* Interrupts can come before env_init() allocates statistics */
+    if (sysstat && tf->tf_trapno < SYSSTAT_NTRAPS) sysstat->st_traps[tf->tf_trapno]++;
+
+    /* Time until now has been spent in user mode */
+    if ((tf->tf_cs & 3) == 3) env_account(curenv, 1);
+
     if (trace_traps) cprintf("Incoming TRAP[%ld] frame at %p\n", tf->tf_trapno, tf);
     if (trace_traps_more) print_trapframe(tf);
 
@@ -357,6 +439,7 @@ trap(struct Trapframe *tf) {
         in_page_fault = 1;
 
         uintptr_t va = rcr2();
+        if (curenv) curenv->env_npgfault++;
 
 #if defined(SANITIZE_USER_SHADOW_BASE) && LAB == 8
         /* NOTE: Hack!
@@ -388,19 +471,38 @@ trap(struct Trapframe *tf) {
                     res ? can_redir ? "redirected to user" : "fault" : "resolved by kernel");
         }
         if (!res) {
+            in_page_fault = 0;
+            if ((tf->tf_cs & 3) == 3) {
+                env_account(curenv, 0);
+                unlock_kernel();
+            }
+            env_pop_tf(tf);
+        }
+
+        /* Bad user memory accessed by copyin() and friends */
+        if ((tf->tf_cs & 3) != 3 && user_fault_fixup(tf, va)) {
             in_page_fault = 0;
             env_pop_tf(tf);
         }
     }
 
-    assert(curenv);
+    if ((tf->tf_cs & 3) == 3) {
+        assert(curenv);
 
-    /* Copy trap frame (which is currently on the stack)
-     * into 'curenv->env_tf', so that running the environment
-     * will restart at the trap point */
-    curenv->env_tf = *tf;
-    /* The trapframe on the stack should be ignored from here on */
-    tf = &curenv->env_tf;
+        /* Garbage collect if current enviroment is a zombie */
+        if (curenv->env_status == ENV_DYING) {
+            env_free(curenv);
+            curenv = NULL;
+            sched_yield();
+        }
+
+        /* Copy trap frame (which is currently on the stack)
+         * into 'curenv->env_tf', so that running the environment
+         * will restart at the trap point */
+        curenv->env_tf = *tf;
+        /* The trapframe on the stack should be ignored from here on */
+        tf = &curenv->env_tf;
+    }
 
     /* Record that tf is the last real trapframe so
      * print_trapframe can print some additional information */
@@ -418,6 +520,63 @@ trap(struct Trapframe *tf) {
         sched_yield();
 }
 
+/* Handle system call made with SYSCALL instruction (see syscall_entry).
+ * This is the shortcut of trap() for T_SYSCALL: the environment gets
+ * back with SYSRET unless some other environment has to run. */
+_Noreturn void
+syscall_trap(struct Trapframe *tf) {
+    /* Halt the CPU if some other CPU has called panic() */
+    extern char *panicstr;
+    if (panicstr) asm volatile("hlt");
+
+    assert(!(read_rflags() & FL_IF));
+
+    lock_kernel();
+    assert(curenv);
+
+    /* Counted as if it were int T_SYSCALL */
+    sysstat->st_traps[T_SYSCALL]++;
+    env_account(curenv, 1);
+
+    if (trace_traps) cprintf("Incoming SYSCALL frame at %p\n", tf);
+
+    /* Garbage collect if current enviroment is a zombie */
+    if (curenv->env_status == ENV_DYING) {
+        env_free(curenv);
+        curenv = NULL;
+        sched_yield();
+    }
+
+    /* System call can block or switch environments,
+     * so the trap frame has to be saved all the same */
+    curenv->env_tf = *tf;
+    tf = &curenv->env_tf;
+    last_tf = tf;
+
+    /* Second parameter is in R10, RCX holds return address */
+    tf->tf_regs.reg_rax = syscall(
+            tf->tf_regs.reg_rax,
+            tf->tf_regs.reg_rdx,
+            tf->tf_regs.reg_r10,
+            tf->tf_regs.reg_rbx,
+            tf->tf_regs.reg_rdi,
+            tf->tf_regs.reg_rsi,
+            tf->tf_regs.reg_r8);
+
+    if (curenv && curenv->env_status == ENV_RUNNING) {
+        /* SYSRET can only return to canonical address in user code segment */
+        if (tf->tf_cs == (GD_UT | 3) && tf->tf_rip < MAX_USER_ADDRESS) {
+            switch_address_space(&curenv->address_space);
+            sched_timer_update();
+            env_account(curenv, 0);
+            unlock_kernel();
+            env_sysret(tf);
+        }
+        env_run(curenv);
+    }
+    sched_yield();
+}
+
 static _Noreturn void
 page_fault_handler(struct Trapframe *tf) {
     uintptr_t cr2 = rcr2();
@@ -8,17 +8,20 @@
 
 #include <inc/trap.h>
 #include <inc/mmu.h>
+#include <kern/cpu.h>
 
 /* The kernel's interrupt descriptor table */
 extern struct Gatedesc idt[];
 extern struct Pseudodesc idt_pd;
 
-extern bool in_page_fault;
+/* We do not support recursive page faults in-kernel */
+#define in_page_fault (thiscpu->cpu_in_page_fault)
 
 void clock_idt_init(void);
 void trap_init(void);
 void trap_init_percpu(void);
 void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
+const char *trapname(int trapno);
 
 #endif /* JOS_KERN_TRAP_H */
@@ -178,6 +178,20 @@ tsc_calibrate(void) {
     return cpu_freq * 1000;
 }
 
+/* Convert nanoseconds to TSC ticks */
+uint64_t
+ns2tsc(uint64_t ns) {
+    uint64_t khz = tsc_calibrate() / 1000;
+    return ns / 1000000 * khz + ns % 1000000 * khz / 1000000;
+}
+
+/* Convert TSC ticks to nanoseconds */
+uint64_t
+tsc2ns(uint64_t ticks) {
+    uint64_t khz = tsc_calibrate() / 1000;
+    return ticks / khz * 1000000 + ticks % khz * 1000000 / khz;
+}
+
 void
 print_time(unsigned seconds) {
     cprintf("%u\n", seconds);
@@ -43,6 +43,8 @@
 #define PIT_IO_CMD       0x43
 
 uint64_t tsc_calibrate(void);
+uint64_t ns2tsc(uint64_t ns);
+uint64_t tsc2ns(uint64_t ticks);
 void timer_start(const char *name);
 void timer_stop(void);
 void timer_cpu_frequency(const char *name);
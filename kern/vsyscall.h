@@ -3,4 +3,6 @@
 
 extern volatile int *vsys;
 
+void vsys_clock_update(void);
+
 #endif
@@ -3,6 +3,12 @@
 
 void
 exit(void) {
+    exit_with(0);
+}
+
+/* Exit reporting status to the parent (see wait()) */
+void
+exit_with(int status) {
     close_all();
-    sys_env_destroy(0);
+    sys_env_exit(status);
 }
@@ -4,6 +4,14 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PAGE_SIZE)));
 
+/* Submission ring shared with the file server */
+#define FSRING ((struct Fsring *)0xCFF00000LL)
+
+static envid_t fsenv;
+/* Environment the ring has been registered by. Children
+ * inherit the ring mapping, but need rings of their own */
+static envid_t fsring_owner;
+
 /* Send an inter-environment request to the file server, and wait for
  * a reply.  The request body should be in fsipcbuf, and parts of the
  * response may be written back to fsipcbuf.
@@ -12,8 +20,6 @@ union Fsipc fsipcbuf __attribute__((aligned(PAGE_SIZE)));
  * Returns result from the file server. */
 static int
 fsipc(unsigned type, void *dstva) {
-    static envid_t fsenv;
-
     if (!fsenv) fsenv = ipc_find_env(ENV_TYPE_FS);
 
     static_assert(sizeof(fsipcbuf) == PAGE_SIZE, "Invalid fsipcbuf size");
@@ -23,9 +29,81 @@ fsipc(unsigned type, void *dstva) {
                 thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
     }
 
-    ipc_send(fsenv, type, &fsipcbuf, PAGE_SIZE, PROT_RW);
-    size_t maxsz = PAGE_SIZE;
-    return ipc_recv(NULL, dstva, &maxsz, NULL);
+    return ipc_call(fsenv, type, &fsipcbuf, PAGE_SIZE, PROT_RW, dstva, NULL);
+}
+
+/* Allocate the submission ring and register it
+ * with the file server, unless it is done already */
+static int
+fsring_setup(void) {
+    if (fsring_owner == thisenv->env_id) return 0;
+    if (!fsenv) fsenv = ipc_find_env(ENV_TYPE_FS);
+
+    /* Drop the ring of the parent if any */
+    int res = sys_unmap_region(CURENVID, FSRING, FSRING_SIZE);
+    if (res < 0) return res;
+    res = sys_alloc_region(CURENVID, FSRING, FSRING_SIZE, PROT_RW | PROT_SHARE);
+    if (res < 0) return res;
+
+    res = ipc_call(fsenv, FSREQ_RING_SETUP, FSRING, FSRING_SIZE, PROT_RW, NULL, NULL);
+    if (res < 0) return res;
+
+    fsring_owner = thisenv->env_id;
+    return 0;
+}
+
+/* Queue request 'req' to the submission ring, 'data' is passed back
+ * with its completion. Returns the request page to fill in,
+ * or NULL if the ring is full (or cannot be set up).
+ * Requests are served by fsring_submit() */
+union Fsipc *
+fsring_prep(uint32_t req, uint64_t data) {
+    if (fsring_setup() < 0) return NULL;
+
+    /* Request page is in use until the completion is reaped */
+    if (FSRING->sq_tail - FSRING->cq_head >= FSRING_NENTRIES) return NULL;
+
+    uint32_t slot = FSRING->sq_tail % FSRING_NENTRIES;
+    FSRING->sq[slot].sqe_req = req;
+    FSRING->sq[slot].sqe_data = data;
+    FSRING->sq_tail++;
+    return &FSRING->req[slot];
+}
+
+/* Make the file server serve all the queued requests
+ * with a single IPC call.
+ * Requests it has not taken are dropped on error,
+ * so that they are not sent again with the next ones.
+ * Returns the number of requests completed, < 0 on error */
+int
+fsring_submit(void) {
+    if (fsring_owner != thisenv->env_id) return -E_INVAL;
+    if (FSRING->sq_head == FSRING->sq_tail) return 0;
+
+    if (debug) {
+        cprintf("[%08x] fsring submit %u\n",
+                thisenv->env_id, FSRING->sq_tail - FSRING->sq_head);
+    }
+
+    int res = ipc_call(fsenv, FSREQ_RING_ENTER, NULL, 0, 0, NULL, NULL);
+    if (res < 0) FSRING->sq_tail = FSRING->sq_head;
+    return res;
+}
+
+/* Reap the oldest completion, storing it to *cqe.
+ * The reply of the request is on the page *reply points to
+ * (if nonnull) until the next request is queued.
+ * Returns 0 if there are no completions */
+bool
+fsring_reap(struct Fsring_cqe *cqe, union Fsipc **reply) {
+    if (fsring_owner != thisenv->env_id) return 0;
+    if (FSRING->cq_head == FSRING->cq_tail) return 0;
+
+    uint32_t slot = FSRING->cq_head % FSRING_NENTRIES;
+    *cqe = FSRING->cq[slot];
+    if (reply) *reply = &FSRING->req[slot];
+    FSRING->cq_head++;
+    return 1;
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -107,26 +185,47 @@ devfile_flush(struct Fd *fd) {
  *  < 0 on error. */
 static ssize_t
 devfile_read(struct Fd *fd, void *buf, size_t n) {
-    /* Make an FSREQ_READ request to the file system server after
-     * filling fsipcbuf.read with the request arguments.  The
-     * bytes read will be written back to fsipcbuf by the file
-     * system server. */
+    /* Queue FSREQ_READ requests for up to FSRING_NENTRIES pages
+     * to the ring, the file system server serves them in order
+     * with a single IPC call. The bytes read are written back
+     * to the request pages. Short read means end of file. */
+
+    int ret = fsring_setup();
+    if (ret < 0) return ret;
 
-    // LAB 10: Your code here:
     size_t res = 0;
-    for (res = 0; res < n;) {
-        fsipcbuf.read.req_fileid = fd->fd_file.id;
-        //FIX LAB 11
-        //fsipcbuf.read.req_n = n;
-        fsipcbuf.read.req_n = MIN(n - res, sizeof(fsipcbuf.readRet.ret_buf));
-
-        int ret;
-        if ((ret = fsipc(FSREQ_READ, NULL)) <= 0) {
-            return ret ? ret : res;
+    while (res < n) {
+        size_t queued = res;
+        while (queued < n) {
+            /* Completion carries the number of bytes requested */
+            size_t next = MIN(n - queued, sizeof(fsipcbuf.readRet.ret_buf));
+            union Fsipc *req = fsring_prep(FSREQ_READ, next);
+            if (!req) break;
+            req->read.req_fileid = fd->fd_file.id;
+            req->read.req_n = next;
+            queued += next;
         }
-        memcpy(buf, fsipcbuf.readRet.ret_buf, ret);
-        buf += ret;
-        res += ret;
+        if ((ret = fsring_submit()) < 0) return ret;
+
+        /* Reap the whole batch even after an error or a short read,
+         * so that its completions are not taken for later requests */
+        bool done = queued == res;
+        ret = 0;
+        struct Fsring_cqe cqe;
+        union Fsipc *reply;
+        while (fsring_reap(&cqe, &reply)) {
+            if (done) continue;
+            if (cqe.cqe_res < 0) {
+                ret = cqe.cqe_res;
+                done = 1;
+                continue;
+            }
+            memcpy(buf + res, reply->readRet.ret_buf, cqe.cqe_res);
+            res += cqe.cqe_res;
+            done = cqe.cqe_res < cqe.cqe_data;
+        }
+        if (ret < 0) return ret;
+        if (done) break;
     }
     return res;
 }
@@ -137,28 +236,37 @@ devfile_read(struct Fd *fd, void *buf, size_t n) {
  *   < 0 on error. */
 static ssize_t
 devfile_write(struct Fd *fd, const void *buf, size_t n) {
-    /* Make an FSREQ_WRITE request to the file system server.  Be
-     * careful: fsipcbuf.write.req_buf is only so large, but
-     * remember that write is always allowed to write *fewer*
-     * bytes than requested, so that multiple IPC requests are
-     * potentially required. */
+    /* Queue FSREQ_WRITE requests to the ring like devfile_read()
+     * does.  Be careful: req_buf of the request page is only
+     * so large, but remember that write is always allowed to
+     * write *fewer* bytes than requested, so that multiple
+     * requests are potentially required. */
+
+    int ret = fsring_setup();
+    if (ret < 0) return ret;
 
-    // LAB 10: Your code here:
     size_t res = 0;
-    for (res = 0; res < n;) {
-        ////FIX LAB 11
-        //size_t next = MIN(n, sizeof(fsipcbuf.write.req_buf));
-        size_t next = MIN(n - res, sizeof(fsipcbuf.write.req_buf));  
-
-        memcpy(fsipcbuf.write.req_buf, buf, next);
-        fsipcbuf.write.req_fileid = fd->fd_file.id;
-        fsipcbuf.write.req_n = next;
-        int ret;
-        if ((ret = fsipc(FSREQ_WRITE, NULL)) < 0) {
-            return ret;
+    while (res < n) {
+        size_t queued = res;
+        while (queued < n) {
+            size_t next = MIN(n - queued, sizeof(fsipcbuf.write.req_buf));
+            union Fsipc *req = fsring_prep(FSREQ_WRITE, next);
+            if (!req) break;
+            memcpy(req->write.req_buf, buf + queued, next);
+            req->write.req_fileid = fd->fd_file.id;
+            req->write.req_n = next;
+            queued += next;
         }
-        buf += ret;
-        res += ret;
+        if ((ret = fsring_submit()) < 0) return ret;
+        if (queued == res) return -E_NO_MEM;
+
+        ret = 0;
+        struct Fsring_cqe cqe;
+        while (fsring_reap(&cqe, NULL)) {
+            if (cqe.cqe_res < 0 && !ret) ret = cqe.cqe_res;
+            if (cqe.cqe_res > 0) res += cqe.cqe_res;
+        }
+        if (ret < 0) return ret;
     }
     return res;
 }
@@ -166,13 +274,22 @@ devfile_write(struct Fd *fd, const void *buf, size_t n) {
 /* Get file information */
 static int
 devfile_stat(struct Fd *fd, struct Stat *st) {
-    fsipcbuf.stat.req_fileid = fd->fd_file.id;
-    int res = fsipc(FSREQ_STAT, NULL);
+    int res = fsring_setup();
     if (res < 0) return res;
 
-    strcpy(st->st_name, fsipcbuf.statRet.ret_name);
-    st->st_size = fsipcbuf.statRet.ret_size;
-    st->st_isdir = fsipcbuf.statRet.ret_isdir;
+    union Fsipc *req = fsring_prep(FSREQ_STAT, 0);
+    if (!req) return -E_NO_MEM;
+    req->stat.req_fileid = fd->fd_file.id;
+    if ((res = fsring_submit()) < 0) return res;
+
+    struct Fsring_cqe cqe;
+    union Fsipc *reply;
+    if (!fsring_reap(&cqe, &reply)) return -E_INVAL;
+    if (cqe.cqe_res < 0) return cqe.cqe_res;
+
+    strcpy(st->st_name, reply->statRet.ret_name);
+    st->st_size = reply->statRet.ret_size;
+    st->st_isdir = reply->statRet.ret_isdir;
 
     return 0;
 }
@@ -26,7 +26,13 @@ fork(void) {
         thisenv = &envs[ENVX(sys_getenvid())];
         return 0;
     }
-    if (sys_map_region(0, NULL, envid, NULL, MAX_USER_ADDRESS, PROT_ALL | PROT_LAZY | PROT_COMBINE) || sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall) || sys_env_set_status(envid, ENV_RUNNABLE))
+    /* Set up and start the child with a single system call */
+    struct SyscallBatch calls[] = {
+            {SYS_map_region, {0, 0, envid, 0, MAX_USER_ADDRESS, PROT_ALL | PROT_LAZY | PROT_COMBINE}},
+            {SYS_env_set_pgfault_upcall, {envid, (uintptr_t)thisenv->env_pgfault_upcall}},
+            {SYS_env_set_status, {envid, ENV_RUNNABLE}},
+    };
+    if (sys_batch(calls, sizeof(calls) / sizeof(*calls)) != sizeof(calls) / sizeof(*calls))
         return -1;
     return envid;
 }
@@ -49,11 +49,10 @@ ipc_recv(envid_t *from_env_store, void *pg, size_t *size, int *perm_store) {
 }
 
 /* Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
- * This function keeps trying until it succeeds.
- * It should panic() on any error other than -E_IPC_NOT_RECV.
+ * This function sleeps in the kernel until 'toenv' receives it.
+ * It panic()s on any error.
  *
  * Hint:
- *   Use sys_yield() to be CPU-friendly.
  *   If 'pg' is null, pass sys_ipc_recv a value that it will understand
  *   as meaning "no page".  (Zero is not the right value.) */
 void
@@ -61,12 +60,50 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, size_t size, int perm) {
     // LAB 9: Your code here:
     if (!pg)
         pg = (void *)MAX_USER_ADDRESS;
-    int errno;
-    while ((errno = sys_ipc_try_send(to_env, val, pg, size, perm))) {
-        if (errno < 0 && errno != -E_IPC_NOT_RECV)
-            panic("Ipc send error. Errno: %i\n", errno);
+    int errno = sys_ipc_send(to_env, val, pg, size, perm, 0);
+    if (errno < 0)
+        panic("Ipc send error. Errno: %i\n", errno);
+}
+
+/* Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env'
+ * and wait for its reply with a single system call.
+ * Reply page, if any, is mapped at 'rcv_pg' (if nonnull),
+ * 'size' limits both request and reply regions.
+ * Sleeps until 'to_env' is receiving, like ipc_send().
+ * If 'perm_store' is nonnull, the reply page permission is stored there.
+ * Returns the value replied, or the error (see ipc_recv()) */
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, size_t size, int perm, void *rcv_pg, int *perm_store) {
+    if (!pg) pg = (void *)MAX_USER_ADDRESS;
+    if (!rcv_pg) rcv_pg = (void *)MAX_USER_ADDRESS;
+
+    int res = sys_ipc_call(to_env, val, pg, size, perm, rcv_pg);
+
+    if (perm_store) *perm_store = res ? 0 : thisenv->env_ipc_perm;
+    return res ? res : thisenv->env_ipc_value;
+}
+
+/* Reply 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env'
+ * if it is nonzero, then receive the next message like ipc_recv() does,
+ * with a single system call. Page of the previous message
+ * mapped at 'rcv_pg' is unmapped.
+ * Keeps trying to reply until 'to_env' is receiving,
+ * reply to the environment that is gone is dropped */
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, size_t size, int perm,
+               envid_t *from_env_store, void *rcv_pg, int *perm_store) {
+    if (!pg) pg = (void *)MAX_USER_ADDRESS;
+    if (!rcv_pg) rcv_pg = (void *)MAX_USER_ADDRESS;
+
+    int res;
+    while ((res = sys_ipc_reply_wait(to_env, val, pg, size, perm, rcv_pg)) == -E_IPC_NOT_RECV)
         sys_yield();
-    }
+    if (res == -E_BAD_ENV)
+        res = sys_ipc_reply_wait(0, 0, NULL, size, 0, rcv_pg);
+
+    if (from_env_store) *from_env_store = res ? 0 : thisenv->env_ipc_from;
+    if (perm_store) *perm_store = res ? 0 : thisenv->env_ipc_perm;
+    return res ? res : thisenv->env_ipc_value;
 }
 
 /* Find the first environment of the given type.  We'll use this to
@@ -14,11 +14,20 @@ struct Dev devpipe = {
         .dev_stat = devpipe_stat,
 };
 
-#define PIPEBUFSIZ (PAGE_SIZE - 2 * sizeof(off_t))
-
+#define PIPEBUFSIZ (PAGE_SIZE - 2 * sizeof(off_t) - 3 * sizeof(uint32_t))
+
+/* Reader waiting for data sleeps on the lower half of p_wpos
+ * and writer waiting for room sleeps on the lower half of p_rpos
+ * (see sys_futex_wait()). The other end only makes futex_wake
+ * system call when p_rwait or p_wwait flag is set.
+ * The kernel wakes them up as well when an environment
+ * sharing the pipe is destroyed without closing it. */
 struct Pipe {
     off_t p_rpos;              /* read position */
     off_t p_wpos;              /* write position */
+    uint32_t p_rwait;          /* reader is waiting for data */
+    uint32_t p_wwait;          /* writer is waiting for room */
+    uint32_t p_closed;         /* one of the ends is closed */
     uint8_t p_buf[PIPEBUFSIZ]; /* data buffer */
 };
 
@@ -73,7 +82,25 @@ err:
 
 static int
 _pipeisclosed(struct Fd *fd, struct Pipe *p) {
-    return !sys_region_refs2(fd, PAGE_SIZE, p, PAGE_SIZE);
+    return p->p_closed || !sys_region_refs2(fd, PAGE_SIZE, p, PAGE_SIZE);
+}
+
+/* Block while *pos is still equal to seen */
+static void
+pipe_wait(uint32_t *waiting, off_t *pos, off_t seen) {
+    /* Announce ourselves before the last check so that
+     * the other end can't miss us after it moves pos */
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(pos, __ATOMIC_SEQ_CST) != seen) return;
+
+    sys_futex_wait((volatile uint32_t *)pos, (uint32_t)seen, 0);
+}
+
+/* Wake up the other end if it is blocked on pos */
+static void
+pipe_wake(uint32_t *waiting, off_t *pos) {
+    if (__atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST))
+        sys_futex_wake((volatile uint32_t *)pos, NENV);
 }
 
 int
@@ -96,26 +123,31 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n) {
     }
 
     uint8_t *buf = vbuf;
-    for (size_t i = 0; i < n; i++) {
-        while (p->p_rpos == p->p_wpos) /* pipe is empty */ {
+    size_t i = 0;
+    while (i < n) {
+        off_t wpos = __atomic_load_n(&p->p_wpos, __ATOMIC_ACQUIRE);
+        if (p->p_rpos == wpos) /* pipe is empty */ {
             /* If we got any data, return it */
-            if (i > 0) return i;
+            if (i > 0) break;
 
             /* If all the writers are gone, note eof */
             if (_pipeisclosed(fd, p)) return 0;
 
-            /* Yield and see what happens */
-            if (debug) cprintf("devpipe_read yield\n");
-            sys_yield();
+            /* Sleep until something is written */
+            if (debug) cprintf("devpipe_read wait\n");
+            pipe_wait(&p->p_rwait, &p->p_wpos, wpos);
+            continue;
         }
 
         /* There's a byte. Take it.
          * Wait to increment rpos until the byte is taken! */
-        buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
-        p->p_rpos++;
+        buf[i++] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
+        __atomic_store_n(&p->p_rpos, p->p_rpos + 1, __ATOMIC_RELEASE);
     }
 
-    return n;
+    /* Writer might be waiting for room */
+    pipe_wake(&p->p_wwait, &p->p_rpos);
+    return i;
 }
 
 static ssize_t
@@ -128,23 +160,30 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n) {
     }
 
     const uint8_t *buf = vbuf;
-    for (size_t i = 0; i < n; i++) {
-        while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) /* pipe is full */ {
+    size_t i = 0;
+    while (i < n) {
+        off_t rpos = __atomic_load_n(&p->p_rpos, __ATOMIC_ACQUIRE);
+        if (p->p_wpos >= rpos + sizeof(p->p_buf)) /* pipe is full */ {
             /* If all the readers are gone
              * (it's only writers like us now),
              * note eof */
             if (_pipeisclosed(fd, p)) return 0;
 
-            /* Yield and see what happens */
-            if (debug) cprintf("devpipe_write yield\n");
-            sys_yield();
+            /* Let reader drain what we have written
+             * and sleep until there is room */
+            if (debug) cprintf("devpipe_write wait\n");
+            pipe_wake(&p->p_rwait, &p->p_wpos);
+            pipe_wait(&p->p_wwait, &p->p_rpos, rpos);
+            continue;
         }
         /* There's room for a byte. Store it.
          * Wait to increment wpos until the byte is stored! */
-        p->p_buf[p->p_wpos % PIPEBUFSIZ] = buf[i];
-        p->p_wpos++;
+        p->p_buf[p->p_wpos % PIPEBUFSIZ] = buf[i++];
+        __atomic_store_n(&p->p_wpos, p->p_wpos + 1, __ATOMIC_RELEASE);
     }
 
+    /* Reader might be waiting for data */
+    pipe_wake(&p->p_rwait, &p->p_wpos);
     return n;
 }
 
@@ -160,6 +199,16 @@ devpipe_stat(struct Fd *fd, struct Stat *stat) {
 
 static int
 devpipe_close(struct Fd *fd) {
+    struct Pipe *p = (struct Pipe *)fd2data(fd);
+
+    /* The last reference to this end is going away,
+     * wake up the other one so it notices */
+    if (sys_region_refs(fd, PAGE_SIZE) == 1) {
+        p->p_closed = 1;
+        pipe_wake(&p->p_rwait, &p->p_wpos);
+        pipe_wake(&p->p_wwait, &p->p_rpos);
+    }
+
     USED(sys_unmap_region(0, fd, PAGE_SIZE));
     return sys_unmap_region(0, fd2data(fd), PAGE_SIZE);
 }
@@ -9,6 +9,33 @@ static int map_segment(envid_t child, uintptr_t va, size_t memsz,
                        int fd, size_t filesz, off_t fileoffset, int perm);
 static int copy_shared_region(void *start, void *end, void *arg);
 
+/* System calls setting up the child are queued here
+ * and issued with as few sys_batch() calls as possible */
+static struct SyscallBatch spawn_calls[SYSBATCH_MAX];
+static size_t spawn_ncalls;
+
+/* Execute queued calls, returns result of the failed one or 0 */
+static int
+spawn_flush(void) {
+    size_t n = spawn_ncalls;
+    spawn_ncalls = 0;
+    if (!n) return 0;
+
+    int res = sys_batch(spawn_calls, n);
+    if (res < 0) return res;
+    return (size_t)res < n ? (int)spawn_calls[res].sb_res : 0;
+}
+
+static int
+spawn_queue(struct SyscallBatch call) {
+    if (spawn_ncalls == SYSBATCH_MAX) {
+        int res = spawn_flush();
+        if (res < 0) return res;
+    }
+    spawn_calls[spawn_ncalls++] = call;
+    return 0;
+}
+
 /* Spawn a child process from a program image loaded from the file system.
  * prog: the pathname of the program to run.
  * argv: pointer to null-terminated array of pointers to strings,
@@ -125,21 +152,20 @@ spawn(const char *prog, const char **argv) {
             goto error;
     }
 
-    close(fd);
-
     /* Copy shared library state. */
-    if ((res = foreach_shared_region(copy_shared_region, &child)) < 0)
-        panic("copy_shared_region: %i", res);
+    if ((res = foreach_shared_region(copy_shared_region, &child)) < 0) goto error;
 
-    if ((res = sys_env_set_trapframe(child, &child_tf)) < 0)
-        panic("sys_env_set_trapframe: %i", res);
+    if ((res = spawn_queue((struct SyscallBatch){SYS_env_set_trapframe, {child, (uintptr_t)&child_tf}})) < 0) goto error;
+    if ((res = spawn_queue((struct SyscallBatch){SYS_env_set_status, {child, ENV_RUNNABLE}})) < 0) goto error;
 
-    if ((res = sys_env_set_status(child, ENV_RUNNABLE)) < 0)
-        panic("sys_env_set_status: %i", res);
+    /* Everything still queued is issued here with a single trap */
+    if ((res = spawn_flush()) < 0) goto error;
 
+    close(fd);
     return child;
 
 error:
+    spawn_ncalls = 0;
     sys_env_destroy(child);
 error2:
     close(fd);
@@ -246,18 +272,17 @@ init_stack(envid_t child, const char **argv, struct Trapframe *tf) {
     tf->tf_rsp = UTEMP2USTACK(&argv_store[-2]);
 
     /* After completing the stack, map it into the child's address space
-     * and unmap it from ours! */
-    if (sys_map_region(0, UTEMP, child, (void *)(USER_STACK_TOP - USER_STACK_SIZE),
-                       USER_STACK_SIZE, PROT_RW) < 0) goto error;
-error:
-    if (sys_unmap_region(0, UTEMP, USER_STACK_SIZE) < 0) goto error;
-    return res;
+     * and unmap it from ours! Both calls are queued, UTEMP is not
+     * reused before the queue is flushed by map_segment() */
+    if ((res = spawn_queue((struct SyscallBatch){SYS_map_region, {0, (uintptr_t)UTEMP, child, USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_SIZE, PROT_RW}})) < 0)
+        return res;
+    return spawn_queue((struct SyscallBatch){SYS_unmap_region, {0, (uintptr_t)UTEMP, USER_STACK_SIZE}});
 }
 
 static int
 copy_shared_region(void *start, void *end, void *arg) {
     envid_t child = *(envid_t *)arg;
-    return sys_map_region(0, start, child, start, end - start, get_prot(start));
+    return spawn_queue((struct SyscallBatch){SYS_map_region, {0, (uintptr_t)start, child, (uintptr_t)start, end - start, get_prot(start)}});
 }
 
 
@@ -284,14 +309,18 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 
     /* Allocate filesz - memsz in child */
     if (memsz > filesz) {
-        res = sys_alloc_region(child, (void *)va + ROUNDUP(filesz, PAGE_SIZE), ROUNDUP(memsz - filesz, PAGE_SIZE), perm);
+        res = spawn_queue((struct SyscallBatch){SYS_alloc_region, {child, va + ROUNDUP(filesz, PAGE_SIZE), ROUNDUP(memsz - filesz, PAGE_SIZE), perm}});
         if (res)
             return res;
     }
     /* Allocate filesz in parent to UTEMP */
     if (filesz == 0)
         return 0;
-    res = sys_alloc_region(CURENVID, UTEMP, ROUNDUP(filesz, PAGE_SIZE), PTE_U | PTE_W | PTE_P);
+    res = spawn_queue((struct SyscallBatch){SYS_alloc_region, {CURENVID, (uintptr_t)UTEMP, ROUNDUP(filesz, PAGE_SIZE), PTE_U | PTE_W | PTE_P}});
+    if (res)
+        return res;
+    /* UTEMP has to be there before reading into it */
+    res = spawn_flush();
     if (res)
         return res;
     /* seek() fd to fileoffset  */
@@ -303,13 +332,9 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
     if (res < 0)
         return res;
     /* Map read section conents to child */
-    res = sys_map_region(CURENVID, UTEMP, child, (void *)va, filesz, perm);
+    res = spawn_queue((struct SyscallBatch){SYS_map_region, {CURENVID, (uintptr_t)UTEMP, child, va, filesz, perm}});
     if (res)
         return res;
     /* Unmap it from parent */
-    res = sys_unmap_region(CURENVID, UTEMP, ROUNDUP(filesz, PAGE_SIZE));
-    if (res)
-        return res;
-
-    return 0;
+    return spawn_queue((struct SyscallBatch){SYS_unmap_region, {CURENVID, (uintptr_t)UTEMP, ROUNDUP(filesz, PAGE_SIZE)}});
 }
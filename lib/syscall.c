@@ -15,24 +15,38 @@ syscall(uintptr_t num, bool check, uintptr_t a1, uintptr_t a2, uintptr_t a3, uin
      */
 
     register uintptr_t _a0 asm("rax") = num,
-                           _a1 asm("rdx") = a1, _a2 asm("rcx") = a2,
+                           _a1 asm("rdx") = a1,
                            _a3 asm("rbx") = a3, _a4 asm("rdi") = a4,
                            _a5 asm("rsi") = a5, _a6 asm("r8") = a6;
 
-    /* Interrupt kernel with T_SYSCALL.
-     *
-     * The "volatile" tells the assembler not to optimize
-     * this instruction away just because we don't use the
-     * return value.
-     *
-     * The last clause tells the assembler that this can
-     * potentially change the condition codes and arbitrary
-     * memory locations. */
-
-    asm volatile("int %1\n"
-                 : "=a"(ret)
-                 : "i"(T_SYSCALL), "r"(_a0), "r"(_a1), "r"(_a2), "r"(_a3), "r"(_a4), "r"(_a5), "r"(_a6)
-                 : "cc", "memory");
+    /* Enter kernel with SYSCALL if it is enabled, which is much
+     * cheaper than an interrupt. SYSCALL stores return address
+     * and flags in RCX and R11, so the second parameter
+     * is passed in R10 instead of RCX */
+    if (vsys[VSYS_syscall]) {
+        register uintptr_t _a2 asm("r10") = a2;
+        asm volatile("syscall\n"
+                     : "=a"(ret)
+                     : "r"(_a0), "r"(_a1), "r"(_a2), "r"(_a3), "r"(_a4), "r"(_a5), "r"(_a6)
+                     : "rcx", "r11", "cc", "memory");
+    } else {
+        register uintptr_t _a2 asm("rcx") = a2;
+
+        /* Interrupt kernel with T_SYSCALL.
+         *
+         * The "volatile" tells the assembler not to optimize
+         * this instruction away just because we don't use the
+         * return value.
+         *
+         * The last clause tells the assembler that this can
+         * potentially change the condition codes and arbitrary
+         * memory locations. */
+
+        asm volatile("int %1\n"
+                     : "=a"(ret)
+                     : "i"(T_SYSCALL), "r"(_a0), "r"(_a1), "r"(_a2), "r"(_a3), "r"(_a4), "r"(_a5), "r"(_a6)
+                     : "cc", "memory");
+    }
 
     if (check && ret > 0) {
         panic("syscall %zd returned %zd (> 0)", num, ret);
@@ -56,6 +70,11 @@ sys_env_destroy(envid_t envid) {
     return syscall(SYS_env_destroy, 1, envid, 0, 0, 0, 0, 0);
 }
 
+void
+sys_env_exit(int status) {
+    syscall(SYS_env_exit, 0, status, 0, 0, 0, 0, 0);
+}
+
 envid_t
 sys_getenvid(void) {
     return syscall(SYS_getenvid, 0, 0, 0, 0, 0, 0, 0);
@@ -137,11 +156,26 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall) {
     return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uintptr_t)upcall, 0, 0, 0, 0);
 }
 
+int
+sys_env_set_priority(envid_t envid, int prio) {
+    return syscall(SYS_env_set_priority, 1, envid, prio, 0, 0, 0, 0);
+}
+
+int
+sys_env_set_fault_around(envid_t envid, size_t npages) {
+    return syscall(SYS_env_set_fault_around, 1, envid, npages, 0, 0, 0, 0);
+}
+
 int
 sys_ipc_try_send(envid_t envid, uintptr_t value, void *srcva, size_t size, int perm) {
     return syscall(SYS_ipc_try_send, 0, envid, value, (uintptr_t)srcva, size, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, size_t size, int perm, uint64_t timeout) {
+    return syscall(SYS_ipc_send, 0, envid, value, (uintptr_t)srcva, size, perm, timeout);
+}
+
 int
 sys_ipc_recv(void *dstva, size_t size) {
     int res = syscall(SYS_ipc_recv, 1, (uintptr_t)dstva, size, 0, 0, 0, 0);
@@ -151,6 +185,61 @@ sys_ipc_recv(void *dstva, size_t size) {
     return res;
 }
 
+int
+sys_env_wait(envid_t envid, int *status) {
+    int res = syscall(SYS_env_wait, 0, envid, 0, 0, 0, 0, 0);
+    if (!res && status) *status = thisenv->env_wait_status;
+    return res;
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t expected, uint64_t timeout) {
+    return syscall(SYS_futex_wait, 0, (uintptr_t)addr, expected, timeout, 0, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int count) {
+    return syscall(SYS_futex_wake, 0, (uintptr_t)addr, count, 0, 0, 0, 0);
+}
+
+int
+sys_batch(struct SyscallBatch *calls, size_t n) {
+    int res = syscall(SYS_batch, 0, (uintptr_t)calls, n, 0, 0, 0, 0);
+#ifdef SANITIZE_USER_SHADOW_BASE
+    /* Do what the stubs above do for the calls that succeeded */
+    for (int i = 0; i < res; i++) {
+        uint64_t *a = calls[i].sb_args;
+        if (calls[i].sb_num == SYS_alloc_region && a[0] == CURENVID &&
+            (a[1] < SANITIZE_USER_SHADOW_BASE || a[1] >= SANITIZE_USER_SHADOW_SIZE + SANITIZE_USER_SHADOW_BASE))
+            platform_asan_unpoison((void *)a[1], a[2]);
+        if (calls[i].sb_num == SYS_map_region && a[2] == CURENVID)
+            platform_asan_unpoison((void *)a[3], a[4]);
+        if (calls[i].sb_num == SYS_unmap_region &&
+            (a[1] < SANITIZE_USER_SHADOW_BASE || a[1] >= SANITIZE_USER_SHADOW_SIZE + SANITIZE_USER_SHADOW_BASE))
+            platform_asan_poison((void *)a[1], a[2]);
+    }
+#endif
+    return res;
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, size_t size, int perm, void *dstva) {
+    int res = syscall(SYS_ipc_call, 0, envid, value, (uintptr_t)srcva, size, perm, (uintptr_t)dstva);
+#ifdef SANITIZE_USER_SHADOW_BASE
+    if (!res) platform_asan_unpoison(dstva, thisenv->env_ipc_maxsz);
+#endif
+    return res;
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, size_t size, int perm, void *dstva) {
+    int res = syscall(SYS_ipc_reply_wait, 0, envid, value, (uintptr_t)srcva, size, perm, (uintptr_t)dstva);
+#ifdef SANITIZE_USER_SHADOW_BASE
+    if (!res) platform_asan_unpoison(dstva, thisenv->env_ipc_maxsz);
+#endif
+    return res;
+}
+
 int
 sys_gettime(void) {
     return syscall(SYS_gettime, 0, 0, 0, 0, 0, 0, 0);
@@ -1,5 +1,6 @@
 #include <inc/vsyscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 static inline uint64_t
 vsyscall(int num) {
@@ -10,7 +11,64 @@ vsyscall(int num) {
     return vsys[num];
 }
 
+/* Nanoseconds passed since vc_base_tsc (kernel boot),
+ * *base_time is set to vc_base_time.
+ * Computed with rdtsc, without entering the kernel */
+static uint64_t
+vsys_clock(uint64_t *base_time) {
+    const volatile struct VsysClock *clock = (const volatile struct VsysClock *)&vsys[VSYS_clock];
+    uint64_t freq, base, tsc;
+    uint32_t seq;
+
+    do {
+        while ((seq = clock->vc_seq) & 1) asm volatile("pause");
+        freq = clock->vc_tsc_freq;
+        base = clock->vc_base_tsc;
+        *base_time = clock->vc_base_time;
+        tsc = read_tsc();
+    } while (clock->vc_seq != seq);
+
+    if (!freq) return 0;
+
+    uint64_t ns = 0;
+    if (tsc > base) {
+        uint64_t ticks = tsc - base;
+        ns = ticks / freq * 1000000000 + ticks % freq * 1000000000 / freq;
+    }
+
+    /* TSCs of different CPUs are not necessarily synchronized,
+     * environment moved to a CPU which TSC lags behind would see
+     * time going backwards. Never return less than the last value
+     * computed from the same base */
+    static uint64_t last_base, last_ns;
+    if (base != last_base) {
+        last_base = base;
+        last_ns = 0;
+    }
+    ns = MAX(ns, last_ns);
+    last_ns = ns;
+    return ns;
+}
+
 int
 vsys_gettime(void) {
-    return vsyscall(VSYS_gettime);
+    uint64_t base_time;
+    uint64_t ns = vsys_clock(&base_time);
+    if (!base_time) return vsyscall(VSYS_gettime);
+    return base_time + ns / 1000000000;
+}
+
+/* Monotonic time in nanoseconds since boot */
+uint64_t
+vsys_clock_ns(void) {
+    uint64_t base_time;
+    return vsys_clock(&base_time);
+}
+
+/* Wall clock time in nanoseconds since epoch */
+uint64_t
+vsys_gettime_ns(void) {
+    uint64_t base_time;
+    uint64_t ns = vsys_clock(&base_time);
+    return base_time * 1000000000 + ns;
 }
@@ -1,14 +1,14 @@
 #include <inc/lib.h>
 
-/* Waits until 'envid' exits. */
-void
+/* Waits until 'envid' exits and returns its exit status
+ * passed to exit_with() (0 for exit(), ENV_EXIT_KILLED
+ * if it has been killed or the status is not known anymore). */
+int
 wait(envid_t envid) {
     assert(envid != 0);
 
-    const volatile struct Env *env = &envs[ENVX(envid)];
+    int status;
+    if (sys_env_wait(envid, &status) < 0) return ENV_EXIT_KILLED;
 
-    while (env->env_id == envid &&
-           env->env_status != ENV_FREE) {
-        sys_yield();
-    }
+    return status;
 }
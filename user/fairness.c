@@ -1,6 +1,11 @@
 /* Demonstrate lack of fairness in IPC.
  * Start three instances of this program as envs 1, 2, and 3.
- * (user/idle is env 0). */
+ * (user/idle is env 0).
+ *
+ * The senders pin themselves to the lowest priority, so the receiver
+ * should get each message as soon as it is sent while they spin:
+ * "recv from" lines should alternate between the senders
+ * instead of coming in long bursts. */
 
 #include <inc/lib.h>
 
@@ -16,6 +21,7 @@ umain(int argc, char **argv) {
             cprintf("%x recv from %x\n", id, who);
         }
     } else {
+        sys_env_set_priority(CURENVID, ENV_PRIO_LOW);
         cprintf("%x loop sending to %x\n", id, envs[1].env_id);
         while (1)
             ipc_send(envs[1].env_id, 0, NULL, 0, 0);
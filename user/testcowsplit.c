@@ -0,0 +1,41 @@
+/* Check that a write to a forked huge page copies only
+ * the written part of it until most of it is written */
+
+#include <inc/lib.h>
+
+#define NPAGES (HUGE_PAGE_SIZE / PAGE_SIZE)
+
+static volatile uint8_t *const area = (volatile uint8_t *)0x40000000;
+
+void
+umain(int argc, char **argv) {
+    int res = sys_alloc_region(0, (void *)area, HUGE_PAGE_SIZE, PROT_RW);
+    if (res < 0) panic("sys_alloc_region: %i", res);
+    for (size_t i = 0; i < NPAGES; i++) area[i * PAGE_SIZE] = 1;
+
+    envid_t who = fork();
+    if (who < 0) panic("fork: %i", who);
+    if (who) {
+        wait(who);
+        return;
+    }
+
+    const volatile struct AddressSpace *space = &thisenv->address_space;
+    uint64_t copied = space->cow_copied;
+    area[0] = 2;
+    copied = space->cow_copied - copied;
+    cprintf("writing a byte copied %lu bytes\n", (unsigned long)copied);
+    if (copied != PAGE_SIZE) panic("sparse write was not copied by 4K page");
+
+    uint32_t faults = thisenv->env_npgfault;
+    for (size_t i = 1; i < NPAGES; i++) area[i * PAGE_SIZE] = 2;
+    faults = thisenv->env_npgfault - faults;
+    cprintf("writing the rest took %u faults\n", faults);
+    if (faults >= NPAGES - 1) panic("dense writes were not copied at once");
+
+    for (size_t i = 0; i < NPAGES; i++)
+        if (area[i * PAGE_SIZE] != 2) panic("page %lu has wrong contents", (unsigned long)i);
+    cprintf("copied %lu bytes for %lu dirtied\n",
+            (unsigned long)space->cow_copied, (unsigned long)space->cow_dirtied);
+    cprintf("cow split is good\n");
+}
@@ -0,0 +1,42 @@
+/* Check that touching lazily allocated pages one after
+ * another resolves the following ones in advance */
+
+#include <inc/lib.h>
+
+#define NPAGES 16
+
+static volatile uint8_t *const area = (volatile uint8_t *)0x10000000;
+
+/* Map NPAGES pages one at a time, so that each one is
+ * a separate lazy mapping, touch them in order and
+ * return the number of page faults it took */
+static uint32_t
+touch_pages(void) {
+    for (int i = 0; i < NPAGES; i++) {
+        int res = sys_alloc_region(0, (void *)(area + i * PAGE_SIZE), PAGE_SIZE, PROT_RW);
+        if (res < 0) panic("sys_alloc_region: %i", res);
+    }
+
+    uint32_t faults = thisenv->env_npgfault;
+    for (int i = 0; i < NPAGES; i++) area[i * PAGE_SIZE] = i;
+    faults = thisenv->env_npgfault - faults;
+
+    for (int i = 0; i < NPAGES; i++)
+        if (area[i * PAGE_SIZE] != i) panic("page %d lost its contents", i);
+    sys_unmap_region(0, (void *)area, NPAGES * PAGE_SIZE);
+    return faults;
+}
+
+void
+umain(int argc, char **argv) {
+    sys_env_set_fault_around(0, 0);
+    uint32_t plain = touch_pages();
+    if (plain < NPAGES) panic("%d pages touched with %u faults without fault-around", NPAGES, plain);
+
+    sys_env_set_fault_around(0, NPAGES);
+    uint32_t around = touch_pages();
+    cprintf("%d pages touched with %u faults, %u without fault-around\n", NPAGES, around, plain);
+    if (around > 2) panic("fault-around did not resolve following pages");
+
+    cprintf("fault-around is good\n");
+}
@@ -0,0 +1,53 @@
+/* Submit a batch of requests to the file server ring
+ * and check that they complete in order */
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv) {
+    int f1 = open("/motd", O_RDONLY);
+    if (f1 < 0) panic("open /motd: %i", f1);
+    int f2 = open("/newmotd", O_RDONLY);
+    if (f2 < 0) panic("open /newmotd: %i", f2);
+
+    struct Fd *fd1, *fd2;
+    if (fd_lookup(f1, &fd1) < 0 || fd_lookup(f2, &fd2) < 0)
+        panic("fd_lookup failed");
+
+    union Fsipc *req = fsring_prep(FSREQ_STAT, 1);
+    req->stat.req_fileid = fd1->fd_file.id;
+    req = fsring_prep(FSREQ_STAT, 2);
+    req->stat.req_fileid = fd2->fd_file.id;
+    req = fsring_prep(FSREQ_READ, 3);
+    req->read.req_fileid = fd2->fd_file.id;
+    req->read.req_n = 16;
+    req = fsring_prep(FSREQ_STAT, 4);
+    req->stat.req_fileid = -1;
+
+    int res = fsring_submit();
+    if (res != 4) panic("fsring_submit: %i", res);
+
+    struct Fsring_cqe cqe;
+    union Fsipc *reply;
+    for (uint64_t i = 1; fsring_reap(&cqe, &reply); i++) {
+        if (cqe.cqe_data != i) panic("completion %ld out of order", (long)cqe.cqe_data);
+        if (i <= 2) {
+            if (cqe.cqe_res < 0) panic("stat: %i", (int)cqe.cqe_res);
+            if (strcmp(reply->statRet.ret_name, i == 1 ? "motd" : "newmotd"))
+                panic("stat returned %s", reply->statRet.ret_name);
+        } else if (i == 3) {
+            if (cqe.cqe_res != 16) panic("read returned %i", (int)cqe.cqe_res);
+            if (strncmp(reply->readRet.ret_buf, "This is the NEW ", 16))
+                panic("read returned wrong data");
+        } else if (cqe.cqe_res != -E_INVAL) {
+            panic("stat of invalid file returned %i", (int)cqe.cqe_res);
+        }
+    }
+    cprintf("fsring batch is good\n");
+
+    /* Reads go through the ring as well */
+    char buf[64];
+    res = readn(f2, buf, sizeof(buf));
+    if (res < 0) panic("readn: %i", res);
+    cprintf("fsring read is good\n");
+}
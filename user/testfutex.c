@@ -0,0 +1,46 @@
+/* Ping-pong a counter between two processes
+ * sleeping on it with sys_futex_wait() */
+
+#include <inc/lib.h>
+
+#define NROUNDS 10
+
+volatile uint32_t *counter = (volatile uint32_t *)0x0FFFF000;
+
+/* Wait for the counter to become even (parent) or odd (child) */
+static uint32_t
+wait_turn(uint32_t parity) {
+    uint32_t val;
+    while ((val = *counter) % 2 != parity) {
+        int res = sys_futex_wait(counter, val, 0);
+        if (res < 0 && res != -E_AGAIN) panic("sys_futex_wait: %i", res);
+    }
+    return val;
+}
+
+void
+umain(int argc, char **argv) {
+    int res = sys_alloc_region(0, (void *)counter, PAGE_SIZE, PROT_RW | PROT_SHARE);
+    if (res < 0) panic("sys_alloc_region: %i", res);
+
+    /* Nobody wakes us up, the wait has to time out */
+    res = sys_futex_wait(counter, 0, 10000000);
+    if (res != -E_TIMEOUT) panic("sys_futex_wait with timeout returned %i", res);
+    res = sys_futex_wait(counter, 1, 0);
+    if (res != -E_AGAIN) panic("sys_futex_wait with wrong value returned %i", res);
+
+    envid_t who = fork();
+    if (who < 0) panic("fork: %i", who);
+    uint32_t parity = !who;
+
+    for (;;) {
+        uint32_t val = wait_turn(parity);
+        if (val >= NROUNDS) break;
+        cprintf("%x got %d\n", sys_getenvid(), val);
+        *counter = val + 1;
+        sys_futex_wake(counter, 1);
+        if (val + 1 >= NROUNDS) break;
+    }
+
+    cprintf("%x futex ping-pong done\n", sys_getenvid());
+}
@@ -0,0 +1,27 @@
+/* Check that system calls are counted
+ * in the read-only statistics page */
+
+#include <inc/lib.h>
+
+#define NCALLS 100
+
+void
+umain(int argc, char **argv) {
+    const volatile struct SyscallStat *stat = &sysstat.st_syscalls[SYS_getenvid];
+
+    uint64_t count = stat->ss_count;
+    for (int i = 0; i < NCALLS; i++) sys_getenvid();
+    if (stat->ss_count - count < NCALLS)
+        panic("%d calls counted as %ld", NCALLS, (long)(stat->ss_count - count));
+
+    uint64_t nreturned = 0;
+    for (int i = 0; i < SYSSTAT_NBUCKETS; i++) nreturned += stat->ss_hist[i];
+    if (nreturned < NCALLS || !stat->ss_cycles) panic("latency of calls is not recorded");
+
+    if (!sysstat.st_traps[T_SYSCALL])
+        panic("system call traps are not counted");
+
+    cprintf("getenvid: %ld calls, %ld ticks on average\n",
+            (long)stat->ss_count, (long)(stat->ss_cycles / nreturned));
+    cprintf("sysstat is good\n");
+}
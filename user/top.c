@@ -0,0 +1,107 @@
+/* Show environments using the CPU the most.
+ * Usage: top [-d delay_ms] [-n iterations] */
+
+#include <inc/lib.h>
+
+static uint64_t prev_time[NENV];
+static envid_t prev_id[NENV];
+static uint64_t cur_time[NENV];
+
+/* Sleeping on this word normally times out as nobody
+ * wakes it up, an early wakeup just redraws sooner */
+static uint32_t sleep_word;
+
+static const char *const status_names[] = {
+        [ENV_FREE] = "free",
+        [ENV_DYING] = "dying",
+        [ENV_RUNNABLE] = "runnable",
+        [ENV_RUNNING] = "running",
+        [ENV_NOT_RUNNABLE] = "blocked",
+};
+
+static void
+usage(void) {
+    printf("usage: top [-d delay_ms] [-n iterations]\n");
+    exit();
+}
+
+static uint64_t
+tsc_freq(void) {
+    const volatile struct VsysClock *clock = (const volatile struct VsysClock *)&vsys[VSYS_clock];
+    return clock->vc_tsc_freq;
+}
+
+/* Print environments sorted by CPU time they used since the previous sample */
+static void
+sample(uint64_t interval_ns) {
+    uint64_t ticks_per_ms = MAX(tsc_freq() / 1000, 1);
+    uint64_t interval_ticks = MAX(interval_ns / 1000000 * ticks_per_ms, 1);
+    static int order[NENV];
+    int n = 0;
+
+    for (int i = 0; i < NENV; i++) {
+        const volatile struct Env *env = &envs[i];
+        if (env->env_status == ENV_FREE) continue;
+
+        uint64_t time = env->env_utime + env->env_ktime;
+        cur_time[i] = prev_id[i] == env->env_id ? time - prev_time[i] : time;
+        prev_time[i] = time;
+        prev_id[i] = env->env_id;
+
+        /* Insertion sort, busiest first */
+        int j = n++;
+        for (; j > 0 && cur_time[order[j - 1]] < cur_time[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    printf("%8s %-8s %5s %9s %9s %7s %7s %7s %7s %7s\n",
+           "ENVID", "STATUS", "CPU%", "USER(ms)", "SYS(ms)",
+           "VCSW", "IVCSW", "PGFAULT", "IPCSENT", "IPCRECV");
+    for (int k = 0; k < n; k++) {
+        const volatile struct Env *env = &envs[order[k]];
+        unsigned status = env->env_status;
+        printf("%08x %-8s %5lu %9lu %9lu %7u %7u %7u %7u %7u\n",
+               env->env_id, status <= ENV_NOT_RUNNABLE ? status_names[status] : "?",
+               (unsigned long)MIN(cur_time[order[k]] * 100 / interval_ticks, 100),
+               (unsigned long)(env->env_utime / ticks_per_ms),
+               (unsigned long)(env->env_ktime / ticks_per_ms),
+               env->env_nvcsw, env->env_nivcsw, env->env_npgfault,
+               env->env_nipcsent, env->env_nipcrecv);
+    }
+}
+
+void
+umain(int argc, char **argv) {
+    struct Argstate args;
+    long delay = 1000, iterations = 3;
+    int i;
+
+    argstart(&argc, argv, &args);
+    while ((i = argnext(&args)) >= 0) {
+        const char *value;
+        switch (i) {
+        case 'd':
+        case 'n':
+            if (!(value = argvalue(&args))) usage();
+            if (i == 'd')
+                delay = strtol(value, NULL, 10);
+            else
+                iterations = strtol(value, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc != 1 || delay <= 0 || iterations <= 0) usage();
+
+    uint64_t start = vsys_clock_ns();
+    for (long k = 0; k < iterations; k++) {
+        sys_futex_wait(&sleep_word, 0, delay * 1000000);
+
+        uint64_t now = vsys_clock_ns();
+        if (k) printf("\n");
+        sample(now - start);
+        start = now;
+    }
+}